@@ -1,7 +1,8 @@
 /* @file open.h
  * @brief Defines an interface around readfile() and writefile() which matches
  * the POSIX-style open()/close()/read()/write()/lseek() file IO calls.
- * Intended to be called in a single-threaded context or with external locking.
+ * The descriptor table is kept by the kernel, so descriptors are shared by
+ * the threads of a task and inherited across fork().
  * @author Chris Williamson (cdw1)
  */
 
@@ -9,17 +10,10 @@
 #define _OPEN_H_
 
 #include <types.h>
+#include <syscall.h> /* O_* and SEEK_* flags */
 
 #define MAX_FNAME   255
 
-#define O_CREAT     0x01
-#define O_RDONLY    0x02
-#define O_RDWR      0x04
-
-#define SEEK_SET    1
-#define SEEK_CUR    2
-#define SEEK_END    3
-
 #define MAX_OPEN_FD 32
 
 int open(const char *filename, int flags);
@@ -0,0 +1,312 @@
+/** @file mkfs.c
+ *  @brief Builds the filesystem image for the Pebbles partition.
+ *
+ *  The layout is deterministic.  The superblock comes first, followed by
+ *  the free space bitmap and the directory blocks.  Then each file is
+ *  written as a single extent, with its data node in the sector directly
+ *  in front of its data.  Files small enough to be stored inline in their
+ *  directory entry take no sectors of their own.
+ *
+ *  Files are placed in the order they are expected to be read.  The
+ *  programs needed to boot come first, then any files named in an access
+ *  order profile in the order given there, then the remaining files in the
+ *  order they were passed.  A profile lists one filename per line; blank
+ *  lines and lines starting with '#' are ignored.
+ *
+ *  The on-disk structures are shared with the kernel through fs_layout.h.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug No known bugs.
+ */
+
+#include "kern/inc/fs_layout.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SECTORS(BYTES) (((BYTES) + FS_SECTOR_SIZE - 1) / FS_SECTOR_SIZE)
+
+#define DEFAULT_OUTPUT "hd.img"
+#define DEFAULT_SECTORS 634966
+#define DEFAULT_SKIP 1
+
+/* Programs read while booting, placed at the front of the disk */
+static const char *boot_files[] = { "init", "idle", "shell" };
+#define NUM_BOOT_FILES (sizeof(boot_files) / sizeof(boot_files[0]))
+
+typedef struct file {
+    char *name;
+    char *data;
+    long size;
+    int rank;
+    int index;
+    int data_node;
+} file_t;
+
+void print_usage() {
+    fprintf(stderr, "Usage: mkfs [-o out] [-d dir] [-n sectors] [-s skip] "
+                    "[-p profile] name:file...\n");
+    fprintf(stderr, "Writes a filesystem holding the given files into the\n");
+    fprintf(stderr, "image out, starting skip sectors into it.  The files\n");
+    fprintf(stderr, "are read from dir and stored under the given names.\n\n");
+}
+
+/** @brief Reads a whole file into memory.
+ *
+ *  @return 0 on success, -1 on failure.
+ */
+static int read_file(const char *dir, const char *path, file_t *file) {
+    char full_path[4096];
+    snprintf(full_path, sizeof(full_path), "%s/%s", dir, path);
+
+    FILE *f = fopen(full_path, "rb");
+    if (f == NULL) {
+        perror(full_path);
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    file->size = ftell(f);
+    rewind(f);
+
+    file->data = malloc(file->size + 1);
+    if (file->data == NULL ||
+        fread(file->data, 1, file->size, f) != (size_t)file->size) {
+        fprintf(stderr, "%s: could not read file\n", full_path);
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/** @brief Ranks files by the order they should be placed on disk.
+ *
+ *  @return 0 on success, -1 if the profile could not be read.
+ */
+static int rank_files(file_t *files, int num_files, const char *profile) {
+    int i;
+    size_t j;
+    for (i = 0; i < num_files; i++) {
+        files[i].rank = -1;
+        for (j = 0; j < NUM_BOOT_FILES; j++) {
+            if (!strcmp(files[i].name, boot_files[j]))
+                files[i].rank = j;
+        }
+    }
+
+    if (profile == NULL)
+        return 0;
+
+    FILE *f = fopen(profile, "r");
+    if (f == NULL) {
+        perror(profile);
+        return -1;
+    }
+
+    int rank = NUM_BOOT_FILES;
+    char line[FS_NAME_LEN + 2];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        for (i = 0; i < num_files; i++) {
+            if (files[i].rank < 0 && !strcmp(files[i].name, line))
+                files[i].rank = rank++;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int compare_files(const void *a, const void *b) {
+    const file_t *fa = a;
+    const file_t *fb = b;
+    // Unranked files have rank -1, so compared unsigned they sort last
+    unsigned ra = fa->rank;
+    unsigned rb = fb->rank;
+    if (ra != rb)
+        return ra < rb ? -1 : 1;
+    return fa->index - fb->index;
+}
+
+static int is_inline(file_t *file) {
+    return file->size <= INLINE_MAX;
+}
+
+static int entry_len(file_t *file) {
+    return DIR_ENTRY_LEN(strlen(file->name), is_inline(file) ? file->size : 0);
+}
+
+/** @brief Counts the directory blocks needed to hold every entry.
+ *
+ *  Entries are packed in order, starting a new block when one is full, in
+ *  the same way write_dirs lays them out.
+ */
+static int count_dir_blocks(file_t *files, int num_files) {
+    int blocks = 0;
+    int used = DIR_BLOCK_SIZE;
+    int i;
+    for (i = 0; i < num_files; i++) {
+        int len = entry_len(&files[i]);
+        if (used + len > DIR_BLOCK_SIZE) {
+            blocks++;
+            used = sizeof(dir_block_t);
+        }
+        used += len;
+    }
+    return blocks;
+}
+
+static void write_dirs(char *image, int dir, file_t *files, int num_files) {
+    dir_block_t *block = NULL;
+    int i;
+    for (i = 0; i < num_files; i++) {
+        file_t *file = &files[i];
+        int len = entry_len(file);
+        if (block == NULL || block->used + len > DIR_BLOCK_SIZE) {
+            if (block != NULL)
+                block->next = dir;
+            block = (dir_block_t *)(image + dir * FS_SECTOR_SIZE);
+            block->constant = DIR_BLOCK_CONSTANT;
+            block->next = 0;
+            block->used = sizeof(dir_block_t);
+            dir += DIR_BLOCK_SECTORS;
+        }
+
+        dir_entry_t *entry = (dir_entry_t *)((char *)block + block->used);
+        char *name = (char *)(entry + 1);
+        entry->len = len;
+        entry->name_len = strlen(file->name);
+        entry->flags = is_inline(file) ? FILE_INLINE : 0;
+        entry->writeable = 1;
+        entry->size = file->size;
+        entry->data_node = file->data_node;
+        memcpy(name, file->name, entry->name_len + 1);
+        if (is_inline(file))
+            memcpy(name + entry->name_len + 1, file->data, file->size);
+        block->used += len;
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *output = DEFAULT_OUTPUT;
+    const char *dir = ".";
+    const char *profile = NULL;
+    long num_sectors = DEFAULT_SECTORS;
+    long skip = DEFAULT_SKIP;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:d:n:s:p:")) != -1) {
+        switch (opt) {
+        case 'o': output = optarg; break;
+        case 'd': dir = optarg; break;
+        case 'n': num_sectors = atol(optarg); break;
+        case 's': skip = atol(optarg); break;
+        case 'p': profile = optarg; break;
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+
+    int num_files = argc - optind;
+    file_t *files = calloc(num_files + 1, sizeof(file_t));
+    if (files == NULL)
+        return 1;
+
+    int i;
+    for (i = 0; i < num_files; i++) {
+        char *arg = argv[optind + i];
+        char *path = strchr(arg, ':');
+        if (path == NULL) {
+            print_usage();
+            return 1;
+        }
+        *path++ = '\0';
+
+        if (strlen(arg) == 0 || strlen(arg) >= FS_NAME_LEN) {
+            fprintf(stderr, "%s: bad filename\n", arg);
+            return 1;
+        }
+        files[i].name = arg;
+        files[i].index = i;
+        if (read_file(dir, path, &files[i]) < 0)
+            return 1;
+    }
+
+    if (rank_files(files, num_files, profile) < 0)
+        return 1;
+    qsort(files, num_files, sizeof(file_t), compare_files);
+
+    superblock_t superblock;
+    memset(&superblock, 0, sizeof(superblock_t));
+    superblock.constant = FS_BITMAP_CONSTANT;
+    superblock.sectors = num_sectors;
+    superblock.bitmap = SUPERBLOCK_ADDR + 1;
+    superblock.bitmap_len = SECTORS((num_sectors + 7) / 8);
+
+    int dir_blocks = count_dir_blocks(files, num_files);
+    size_t sector = superblock.bitmap + superblock.bitmap_len;
+    if (dir_blocks > 0)
+        superblock.dir = sector;
+    sector += dir_blocks * DIR_BLOCK_SECTORS;
+
+    for (i = 0; i < num_files; i++) {
+        if (is_inline(&files[i]))
+            continue;
+        files[i].data_node = sector;
+        sector += 1 + SECTORS(files[i].size);
+    }
+
+    if (num_sectors < 0 || sector > (size_t)num_sectors) {
+        fprintf(stderr, "Filesystem is too big for the disk.\n");
+        return 1;
+    }
+
+    char *image = calloc(sector, FS_SECTOR_SIZE);
+    if (image == NULL)
+        return 1;
+
+    memcpy(image, &superblock, sizeof(superblock_t));
+
+    // Everything written is allocated; the rest of the disk is free
+    char *bitmap = image + superblock.bitmap * FS_SECTOR_SIZE;
+    size_t s;
+    for (s = 0; s < sector; s++)
+        bitmap[s / 8] |= 1 << (s % 8);
+
+    write_dirs(image, superblock.dir, files, num_files);
+
+    for (i = 0; i < num_files; i++) {
+        file_t *file = &files[i];
+        if (is_inline(file))
+            continue;
+        data_node_t *data_node =
+            (data_node_t *)(image + file->data_node * FS_SECTOR_SIZE);
+        data_node->next = 0;
+        data_node->len = SECTORS(file->size);
+        data_node->start = file->data_node + 1;
+        memcpy(image + data_node->start * FS_SECTOR_SIZE, file->data,
+               file->size);
+    }
+
+    FILE *out = fopen(output, "rb+");
+    if (out == NULL) {
+        perror(output);
+        return 1;
+    }
+    if (fseek(out, skip * FS_SECTOR_SIZE, SEEK_SET) < 0 ||
+        fwrite(image, FS_SECTOR_SIZE, sector, out) != sector) {
+        fprintf(stderr, "%s: could not write image\n", output);
+        fclose(out);
+        return 1;
+    }
+    fclose(out);
+
+    return 0;
+}
@@ -15,6 +15,12 @@ endif
 
 410UCLEANS+=$(410UDIR)/exec2obj $(410UDIR)/exec2obj.dep
 
+# The image builder shares the filesystem's on-disk structures with the kernel
+$(410UDIR)/mkfs: $(410UDIR)/mkfs.c $(STUKDIR)/inc/fs_layout.h
+	$(CC) -m32 -I. -Wall -Werror -o $@ $<
+
+410UCLEANS+=$(410UDIR)/mkfs
+
 $(PROGS:%=$(BUILDDIR)/%) :
 $(BUILDDIR)/%.strip : $(BUILDDIR)/%
 	strip -o $@ $<
@@ -41,13 +47,14 @@ include $(patsubst %.a,$(410UDIR)/%/user.mk,$(410USER_LIBS_EARLY) $(410USER_LIBS
 
 IMGDIR=/tmp/$(USER).img
 IMGFILE=$(IMGDIR)/hd.img
-$(IMGFILE): $(410KDIR)/hd.img.gz $(PROGS:%=$(BUILDDIR)/%.strip) $(FILES:%=$(BUILDDIR)/%)
+$(IMGFILE): $(410KDIR)/hd.img.gz $(410UDIR)/mkfs $(FS_PROFILE) \
+            $(PROGS:%=$(BUILDDIR)/%.strip) $(FILES:%=$(BUILDDIR)/%)
 	if [ -f $(IMGFILE) ] ; then rm $(IMGFILE) ; fi
 	if [ -f $(IMGFILE).tmp ] ; then rm $(IMGFILE).tmp ; fi
 	if [ -d $(IMGDIR) ] ; then rmdir $(IMGDIR) ; fi
 	(umask 077 && mkdir -m 700 $(IMGDIR))
 	gunzip < $(410KDIR)/hd.img.gz > $(IMGFILE).tmp
-	python $(410UDIR)/packer.py -o $(IMGFILE).tmp -s 16065 -n 614400 -d $(BUILDDIR) $(foreach PROG,$(PROGS),$(PROG):$(PROG).strip) $(foreach FILE,$(FILES),$(FILE):$(FILE))
+	$(410UDIR)/mkfs -o $(IMGFILE).tmp -s 16065 -n 614400 -d $(BUILDDIR) $(if $(FS_PROFILE),-p $(FS_PROFILE)) $(foreach PROG,$(PROGS),$(PROG):$(PROG).strip) $(foreach FILE,$(FILES),$(FILE):$(FILE))
 	mv $(IMGFILE).tmp $(IMGFILE)
 
 ################# FILE-SYSTEM IMAGE #################
@@ -50,7 +50,7 @@ work yield_desc_mkrun TinyBasic
 # A list of the test programs you want compiled in from the user/progs
 # directory.
 #
-STUDENTTESTS = read size delete write
+STUDENTTESTS = read size delete write write_empty extents append diskstats prealloc_clone
 
 ###########################################################################
 # Data files provided by course staff to build into the RAM disk
@@ -68,6 +68,15 @@ STUDENTTESTS = read size delete write
 #
 STUDENTFILES =
 
+###########################################################################
+# Access order profile for the disk image
+###########################################################################
+# A file listing one filename per line.  mkfs places the listed files on
+# disk in that order, directly after the programs needed to boot.  Leave
+# blank to place the remaining files in the order they are built.
+#
+FS_PROFILE =
+
 ###########################################################################
 # Object files for your thread library
 ###########################################################################
@@ -89,7 +98,10 @@ SYSCALL_OBJS = fork.o exec.o wait.o yield.o deschedule.o \
 make_runnable.o gettid.o new_pages.o remove_pages.o sleep.o getchar.o \
 readline.o print.o set_term_color.o set_cursor_pos.o get_cursor_pos.o \
 get_ticks.o misbehave.o halt.o task_vanish.o set_status.o vanish.o \
-readfile.o sizefile.o writefile.o deletefile.o swexn.o
+readfile.o sizefile.o writefile.o deletefile.o swexn.o openfile.o readfd.o \
+writefd.o seekfd.o closefd.o mapfile.o aioread.o aiowrite.o aiopoll.o \
+aiowait.o clonefile.o syncfd.o preallocfile.o extentsfile.o \
+diskpoll.o diskstats.o
 
 ###########################################################################
 # Object files for your automatic stack handling
@@ -110,7 +122,8 @@ KERNEL_OBJS = console.o kernel.o loader.o malloc_wrappers.o hashtable.o \
 linklist.o circbuf.o handler.o interrupt.o vm.o proc.o fork.o \
 scheduler.o context_switch.o keyboard.o timer.o asm_common.o \
 exception.o exception_asm.o atom_xchg.o spinlock.o mutex.o cond.o \
-kern_common.o disk.o rwlock.o memlock.o free_page_linklist.o ide-dma.o
+kern_common.o disk.o rwlock.o memlock.o free_page_linklist.o ide-dma.o \
+journal.o fd.o aio.o writeback.o
 
 ###########################################################################
 # WARNING: Do not put **test** programs into the REQPROGS variables.  Your
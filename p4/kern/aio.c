@@ -0,0 +1,437 @@
+/** @file aio.c
+ *  @brief This file implements the asynchronous file I/O system calls.
+ *
+ *  A request is split into transfers between the disk and a kernel buffer,
+ *  which are queued with the disk driver and completed from the IDE
+ *  interrupt handler, so no thread waits on them.  The data of a write is
+ *  copied in when it is submitted; the data of a read is copied out to the
+ *  caller's buffer when the request is reaped by aiopoll or aiowait, so the
+ *  buffer need only be valid then.
+ *
+ *  Requests the driver cannot carry out on its own, such as writes which
+ *  grow the file or do not cover whole sectors, or files whose data is
+ *  inline, are carried out synchronously when they are submitted.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug No known bugs.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include <asm.h>
+#include <ide.h>
+#include <kern_common.h>
+#include <asm_common.h>
+#include <scheduler.h>
+#include <waiter.h>
+#include <ide-dma.h>
+#include <disk.h>
+#include <proc.h>
+#include <fd.h>
+#include <aio.h>
+
+/* An outstanding request */
+typedef struct aio_req {
+    int id;
+    bool write;
+    bool mapped;
+    fs_file_t *file;
+    char *buf;
+    char *kernel_buf;
+    int skip;
+    int rv;
+    /* Transfers still in flight, only touched with interrupts disabled */
+    int pending;
+    dma_req_t *dma;
+    aio_table_t *table;
+    listnode_t listnode;
+} aio_req_t;
+
+/** @brief Initializes an empty request table.
+ *
+ *  @param table The table.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int aio_table_init(aio_table_t *table)
+{
+    if (mutex_init(&table->lock) < 0)
+        return -1;
+
+    if (linklist_init(&table->reqs) < 0 ||
+        linklist_init(&table->waiters) < 0)
+        return -2;
+
+    table->num_reqs = 0;
+    table->next_id = 0;
+    table->completed = 0;
+
+    return 0;
+}
+
+/** @brief Counts a completed request and wakes the threads waiting for one.
+ *
+ *  Must be called with interrupts disabled.
+ */
+static void complete_req(aio_table_t *table) {
+    table->completed++;
+
+    waiter_t *waiter;
+    while (linklist_remove_head(&table->waiters, (void **)&waiter, NULL) == 0) {
+        waiter->reject = 1;
+        make_runnable_kern(waiter->tcb, false);
+    }
+}
+
+/** @brief Completes a transfer of a request.
+ *
+ *  Called from the IDE interrupt handler.
+ */
+static void dma_done(dma_req_t *dma, int rv) {
+    aio_req_t *req = dma->data;
+
+    if (rv < 0)
+        req->rv = -5;
+
+    if (--req->pending == 0)
+        complete_req(req->table);
+}
+
+static bool req_complete(void *data, void *key) {
+    return ((aio_req_t *)data)->pending == 0;
+}
+
+/** @brief Takes a completed request off a table.
+ *
+ *  Must be called with the table lock held.
+ *
+ *  @return The request, or NULL if none has completed.
+ */
+static aio_req_t *take_req(aio_table_t *table) {
+    aio_req_t *req;
+    if (linklist_remove(&table->reqs, NULL, req_complete,
+                        (void **)&req, NULL) < 0)
+        return NULL;
+
+    table->num_reqs--;
+
+    disable_interrupts();
+    table->completed--;
+    enable_interrupts();
+
+    return req;
+}
+
+/** @brief Waits until a request of a table completes.
+ *
+ *  Must be called with the table lock held, which is dropped while waiting.
+ */
+static void wait_req(aio_table_t *table) {
+    waiter_t waiter = {gettcb(), 0};
+    listnode_t node;
+
+    mutex_unlock(&table->lock);
+
+    disable_interrupts();
+    if (table->completed == 0) {
+        linklist_add_tail(&table->waiters, (void *)&waiter, &node);
+        deschedule_kern(&waiter.reject, false);
+    }
+    enable_interrupts();
+
+    mutex_lock(&table->lock);
+}
+
+/** @brief Releases a completed request.
+ *
+ *  @param req The request.
+ *  @param copy Whether to copy the data of a read to the caller's buffer.
+ *  @return The result of the request.
+ */
+static int finish_req(aio_req_t *req, bool copy) {
+    int rv = req->rv;
+
+    if (req->mapped)
+        fs_unmap(req->file, req->write);
+
+    if (copy && !req->write && rv > 0) {
+        if (buf_lock_rw(rv, req->buf) < 0) {
+            rv = -6;
+        } else {
+            memcpy(req->buf, req->kernel_buf + req->skip, rv);
+            buf_unlock(rv, req->buf);
+        }
+    }
+
+    fs_close(req->file);
+    free(req->dma);
+    free(req->kernel_buf);
+    free(req);
+
+    return rv;
+}
+
+/** @brief Waits for every request of a table to complete and releases them.
+ *
+ *  Called when a process exits; the results are discarded.
+ *
+ *  @param table The table.
+ */
+void aio_table_clear(aio_table_t *table)
+{
+    mutex_lock(&table->lock);
+    while (!linklist_empty(&table->reqs)) {
+        aio_req_t *req = take_req(table);
+        if (req == NULL)
+            wait_req(table);
+        else
+            finish_req(req, false);
+    }
+    mutex_unlock(&table->lock);
+}
+
+/** @brief Splits a request over runs of sectors into transfers.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int build_dma(aio_req_t *req, fs_run_t *runs, int num_runs) {
+    int num_dma = 0;
+    int i;
+    for (i = 0; i < num_runs; i++)
+        num_dma += (runs[i].len + DMA_MAX_SECTORS - 1) / DMA_MAX_SECTORS;
+
+    if (num_dma == 0)
+        return 0;
+
+    req->dma = malloc(num_dma * sizeof(dma_req_t));
+    if (req->dma == NULL)
+        return -1;
+
+    unsigned pa = (unsigned)req->kernel_buf;
+    dma_req_t *dma = req->dma;
+    for (i = 0; i < num_runs; i++) {
+        int done = 0;
+        while (done < runs[i].len) {
+            dma->addr = runs[i].sector + done;
+            dma->pa = pa;
+            dma->segs = NULL;
+            dma->count = MIN(DMA_MAX_SECTORS, runs[i].len - done);
+            dma->write = req->write;
+            dma->done = dma_done;
+            dma->data = req;
+            done += dma->count;
+            pa += dma->count * IDE_SECTOR_SIZE;
+            dma++;
+        }
+    }
+    req->pending = num_dma;
+
+    return 0;
+}
+
+/** @brief Submits an asynchronous read or write.
+ *
+ *  @return The request id on success, negative error code otherwise.
+ */
+static int submit(int fd, char *buf, int count, int offset, bool write) {
+    if (count < 0 || offset < 0 || offset + count < offset)
+        return -1;
+
+    aio_table_t *table = &getpcb()->aio;
+
+    // Reserve a slot first, so a request carried out now is never refused
+    mutex_lock(&table->lock);
+    bool full = table->num_reqs == AIO_MAX_REQS;
+    if (!full)
+        table->num_reqs++;
+    mutex_unlock(&table->lock);
+    if (full)
+        return -2;
+
+    fs_file_t *file = fd_file(fd, write ? O_RDWR : 0);
+    aio_req_t *req = malloc(sizeof(aio_req_t));
+    int skip = write ? 0 : offset % IDE_SECTOR_SIZE;
+    unsigned len = ((unsigned)skip + count + IDE_SECTOR_SIZE - 1) &
+                   ~(IDE_SECTOR_SIZE - 1);
+    char *kernel_buf = len > 0 ? malloc(len) : NULL;
+    if (file == NULL || req == NULL || (len > 0 && kernel_buf == NULL)) {
+        if (file != NULL)
+            fs_close(file);
+        free(req);
+        free(kernel_buf);
+        mutex_lock(&table->lock);
+        table->num_reqs--;
+        mutex_unlock(&table->lock);
+        return file == NULL ? -3 : -4;
+    }
+
+    if (write)
+        memcpy(kernel_buf, buf, count);
+
+    req->write = write;
+    req->file = file;
+    req->buf = buf;
+    req->kernel_buf = kernel_buf;
+    req->skip = skip;
+    req->pending = 0;
+    req->dma = NULL;
+    req->table = table;
+
+    fs_run_t *runs;
+    int num_runs;
+    int rv = fs_map(file, count, offset, write, &runs, &num_runs);
+    if (rv < 0) {
+        // Needs the filesystem, so do it now
+        req->mapped = false;
+        req->skip = 0;
+        if (write)
+            req->rv = fs_pwrite(file, kernel_buf, count, offset);
+        else
+            req->rv = fs_pread(file, kernel_buf, count, offset);
+    } else {
+        req->mapped = true;
+        req->rv = rv;
+        rv = build_dma(req, runs, num_runs);
+        free(runs);
+        if (rv < 0)
+            req->rv = -4;
+    }
+
+    mutex_lock(&table->lock);
+
+    req->id = table->next_id;
+    if (++table->next_id < 0)
+        table->next_id = 0;
+    linklist_add_tail(&table->reqs, (void *)req, &req->listnode);
+
+    int id = req->id;
+    int num_dma = req->pending;
+
+    disable_interrupts();
+    if (num_dma == 0)
+        complete_req(table);
+    enable_interrupts();
+
+    // The request may complete, and be reaped, as soon as this is queued
+    int i;
+    for (i = 0; i < num_dma; i++) {
+        dma_req_t *dma = &req->dma[i];
+        if (dma_submit(dma) < 0) {
+            disable_interrupts();
+            dma_done(dma, -1);
+            enable_interrupts();
+        }
+    }
+
+    mutex_unlock(&table->lock);
+
+    return id;
+}
+
+/** @brief Starts reading from a descriptor without waiting for the data.
+ *
+ *  The data is copied into buf when the request is reaped.
+ *
+ *  @param fd The descriptor.
+ *  @param buf The buffer, which must be valid when the request is reaped.
+ *  @param count The maximum number of bytes to read.
+ *  @param offset The offset in the file to start reading at.
+ *  @return The request id on success, negative error code otherwise.
+ */
+int aioread(int fd, char *buf, int count, int offset)
+{
+    return submit(fd, buf, count, offset, false);
+}
+
+/** @brief Starts writing to a descriptor without waiting for the disk.
+ *
+ *  The data is copied out of buf before the call returns.
+ *
+ *  @param fd The descriptor, which must have been opened with O_RDWR.
+ *  @param buf The buffer.
+ *  @param count The number of bytes to write.
+ *  @param offset The offset in the file to start writing at.
+ *  @return The request id on success, negative error code otherwise.
+ */
+int aiowrite(int fd, char *buf, int count, int offset)
+{
+    return submit(fd, buf, count, offset, true);
+}
+
+/** @brief Reaps completed requests of the invoking process.
+ *
+ *  @return The number of requests reaped on success, negative error code
+ *  otherwise.
+ */
+static int reap(aio_result_t *results, int count, bool block) {
+    if (count < 0)
+        return -1;
+
+    // No more can be outstanding, which also keeps the length from overflowing
+    count = MIN(count, AIO_MAX_REQS);
+    int len = count * sizeof(aio_result_t);
+    if (count > 0 && buf_lock_rw(len, (char *)results) < 0)
+        return -2;
+
+    aio_table_t *table = &getpcb()->aio;
+    linklist_t done;
+    linklist_init(&done);
+
+    mutex_lock(&table->lock);
+    int num = 0;
+    while (num < count) {
+        aio_req_t *req = take_req(table);
+        if (req != NULL) {
+            linklist_add_tail(&done, (void *)req, &req->listnode);
+            num++;
+        } else if (block && num == 0 && !linklist_empty(&table->reqs)) {
+            wait_req(table);
+        } else {
+            break;
+        }
+    }
+    mutex_unlock(&table->lock);
+
+    int i;
+    for (i = 0; i < num; i++) {
+        aio_req_t *req;
+        linklist_remove_head(&done, (void **)&req, NULL);
+        results[i].id = req->id;
+        results[i].rv = finish_req(req, true);
+    }
+
+    if (count > 0)
+        buf_unlock(len, (char *)results);
+
+    return num;
+}
+
+/** @brief Reaps requests which have completed, without waiting.
+ *
+ *  The result of each request is that its synchronous counterpart would have
+ *  returned.
+ *
+ *  @param results The buffer to store the results in.
+ *  @param count The most results to store.
+ *  @return The number of results stored on success, negative error code
+ *  otherwise.
+ */
+int aiopoll(aio_result_t *results, int count)
+{
+    return reap(results, count, false);
+}
+
+/** @brief Reaps completed requests, waiting for one if none has completed.
+ *
+ *  Returns 0 straight away if no request is outstanding.
+ *
+ *  @param results The buffer to store the results in.
+ *  @param count The most results to store.
+ *  @return The number of results stored on success, negative error code
+ *  otherwise.
+ */
+int aiowait(aio_result_t *results, int count)
+{
+    return reap(results, count, true);
+}
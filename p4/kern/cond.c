@@ -102,7 +102,7 @@ void cond_broadcast(cond_t *cv)
     spinlock_unlock(&cv->wait_lock);
 
     waiter_t *waiter;
-    while (linklist_remove_head(&cv->wait_list, (void**)&waiter, NULL) == 0) {
+    while (linklist_remove_head(&list, (void**)&waiter, NULL) == 0) {
         waiter->reject = 1;
         make_runnable_kern(waiter->tcb, false);
     }
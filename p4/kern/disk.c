@@ -13,359 +13,3244 @@
 #include <fs.h>
 #include <kern_common.h>
 #include <assert.h>
+#include <hashtable.h>
+#include <mutex.h>
+#include <cond.h>
+#include <rwlock.h>
+#include <vm.h>
+#include <ide-dma.h>
+#include <journal.h>
+#include <writeback.h>
+#include <fs_layout.h>
+#include <disk.h>
 
-#define SUPERBLOCK_ADDR 0
+#define NAMES_HT_SIZE 128
+#define REFS_HT_SIZE 64
+#define EXTENTS_INIT_SIZE 4
+
+/* Pages a single read into a user buffer can span */
+#define READ_MAX_SEGS (DMA_MAX_SECTORS * IDE_SECTOR_SIZE / PAGE_SIZE + 1)
+
+#define READAHEAD_MIN 8
+#define READAHEAD_MAX 64
+
+/* Sectors copied per transfer when defragmenting or unsharing */
+#define DEFRAG_CHUNK 128
+/* Ticks without foreground I/O before the defragmenter does any work */
+#define DEFRAG_IDLE_TICKS 50
+/* Ticks between scans once nothing is left to defragment */
+#define DEFRAG_PERIOD 1000
 
 #define SECTOR_MASK (~(IDE_SECTOR_SIZE - 1))
 #define PREV_SECTOR(OFFSET) ((unsigned)(OFFSET) & SECTOR_MASK)
 #define NEXT_SECTOR(OFFSET) (PREV_SECTOR((OFFSET) + IDE_SECTOR_SIZE))
+#define BITS_PER_SECTOR (IDE_SECTOR_SIZE * 8)
+#define SECTOR_USED(SECTOR) (fs.bitmap[(SECTOR) / 8] & (1 << ((SECTOR) % 8)))
+#define SECTORS(BYTES) (((unsigned)(BYTES) + IDE_SECTOR_SIZE - 1) / IDE_SECTOR_SIZE)
 
-typedef struct superblock {
-    int constant;
-    int file_node;
-    int free_node;
-    char padding[IDE_SECTOR_SIZE - 12];
-} superblock_t;
+/* A contiguous run of a file's data, in sectors.  Sectors from written on
+ * were preallocated but never written, and read as zeros. */
+typedef struct fs_extent {
+    int node;
+    int logical;
+    int start;
+    int len;
+    int written;
+} fs_extent_t;
 
-typedef struct free_node {
+/* Sequential readahead state of a file, in sectors */
+typedef struct fs_readahead {
     int next;
+    int window;
+    int start;
     int len;
-    char padding[IDE_SECTOR_SIZE - 8];
-} free_node_t;
+    char *buf;
+    bool pending;
+    int gen;
+} fs_readahead_t;
 
-typedef struct file_node {
-    int next;
-    char filename[MAX_EXECNAME_LEN];
+/* In-memory copy of a directory entry, kept in the name index while it
+ * exists and alive while it is open.  Its lock is held shared while its
+ * data is read and exclusively while its data or extents change, and is
+ * always taken before the filesystem lock. */
+struct fs_file {
+    rwlock_t lock;
+    struct fs_dir *dir;
+    int entry_len;
+    char *filename;
     uint32_t size;
     int writeable;
     int data_node;
-    char padding[IDE_SECTOR_SIZE - 16 -
-                 MAX_EXECNAME_LEN*sizeof(char)];
-} file_node_t;
+    char *inline_data;
+    fs_extent_t *extents;
+    int num_extents;
+    int max_extents;
+    fs_readahead_t ra;
+    int data_gen;
+    int readers;
+    int refs;
+    bool deleted;
+    bool shared;
+    struct fs_file *hash_next;
+    struct fs_file *dir_prev;
+    struct fs_file *dir_next;
+};
 
-typedef struct data_node {
-    int next;
+/* In-memory copy of a directory block and the files whose entries it holds */
+typedef struct fs_dir {
+    int addr;
+    int used;
+    bool dirty;
+    char *buf;
+    fs_file_t *files;
+    struct fs_dir *next;
+} fs_dir_t;
+
+/* A run of free sectors, kept sorted by start in the free list */
+typedef struct fs_free {
+    int start;
     int len;
+    struct fs_free *next;
+} fs_free_t;
+
+/* A window of a file queued for the readahead thread */
+typedef struct fs_ra_req {
+    fs_file_t *file;
+    int gen;
     int start;
-    char padding[IDE_SECTOR_SIZE - 12];
-} data_node_t;
+    int len;
+    struct fs_ra_req *next;
+} fs_ra_req_t;
+
+/* The mounted filesystem */
+typedef struct fs {
+    mutex_t lock;
+    superblock_t superblock;
+    bool superblock_dirty;
+    char *bitmap;
+    bool *bitmap_dirty;
+    fs_free_t *free;
+    hashtable_t names;
+    hashtable_t shared;
+    fs_dir_t *dirs;
+    cond_t ra_cv;
+    fs_ra_req_t *ra_head;
+    fs_ra_req_t *ra_tail;
+    fs_file_t *ra_current;
+    int ra_gen;
+    bool ra_thread;
+    unsigned io_ticks;
+    cond_t readers_cv;
+} fs_t;
+
+static fs_t fs;
 
 static int read_superblock(superblock_t *superblock) {
     int rv = dma_read(SUPERBLOCK_ADDR, (void *)superblock, 1);
-    if (!rv)
-        assert(superblock->constant == FS_MAGIC_CONSTANT);
+    if (!rv && superblock->constant != FS_MAGIC_CONSTANT &&
+        superblock->constant != FS_BITMAP_CONSTANT)
+        return -1;
     return rv;
 }
 
 static int read_file_node(unsigned long addr, file_node_t *file_node) {
-    return dma_read(addr, (void *)file_node, 1);
+    return journal_read(addr, (void *)file_node);
 }
 
 static int read_data_node(unsigned long addr, data_node_t *data_node) {
-    return dma_read(addr, (void *)data_node, 1);
+    return journal_read(addr, (void *)data_node);
 }
 
-static int write_superblock(superblock_t *superblock) {
-    superblock->constant = FS_MAGIC_CONSTANT;
-    return dma_write(SUPERBLOCK_ADDR, (void *)superblock, 1);
+static int read_free_node(unsigned long addr, free_node_t *free_node) {
+    return dma_read(addr, (void *)free_node, 1);
 }
 
-static int write_file_node(unsigned long addr, file_node_t *file_node) {
-    return dma_write(addr, (void *)file_node, 1);
+static int write_superblock(superblock_t *superblock) {
+    return journal_write(SUPERBLOCK_ADDR, (void *)superblock);
 }
 
-static int write_free_node(unsigned long addr, free_node_t *free_node) {
-    return dma_write(addr, (void *)free_node, 1);
-}
+/** @brief Writes the cached superblock back to disk if it has changed.
+ *
+ *  Must be called with the filesystem lock held.
+ */
+static int flush_superblock() {
+    if (!fs.superblock_dirty)
+        return 0;
 
-static int get_file_node(char *filename, file_node_t *file_node) {
-    superblock_t *superblock = malloc(sizeof(superblock_t));
-    if (superblock == NULL)
+    if (write_superblock(&fs.superblock) < 0)
         return -1;
-    if (read_superblock(superblock) < 0) {
-        free(superblock);
-        return -2;
-    }
 
-    int addr = superblock->file_node;
-    free(superblock);
-    while (addr != 0) {
-        if (read_file_node(addr, file_node) < 0)
-            return -3;
-        if (!strncmp(file_node->filename, filename, MAX_EXECNAME_LEN))
-            return 0;
-        addr = file_node->next;
+    fs.superblock_dirty = false;
+    return 0;
+}
+
+/** @brief Writes the changed sectors of the free space bitmap to disk.
+ *
+ *  Must be called with the filesystem lock held.
+ */
+static int flush_bitmap() {
+    int rv = 0;
+
+    int i;
+    for (i = 0; i < fs.superblock.bitmap_len; i++) {
+        if (!fs.bitmap_dirty[i])
+            continue;
+        if (journal_write(fs.superblock.bitmap + i,
+                          fs.bitmap + i * IDE_SECTOR_SIZE) < 0) {
+            rv = -1;
+            continue;
+        }
+        fs.bitmap_dirty[i] = false;
     }
 
-    return -4;
+    return rv;
 }
 
-static int remove_file_node(char *filename, file_node_t *file_node) {
-    superblock_t *superblock = malloc(sizeof(superblock_t));
-    if (superblock == NULL)
-        return -1;
-    if (read_superblock(superblock) < 0) {
-        free(superblock);
-        return -2;
+/** @brief Serializes a directory block from its in-memory files. */
+static void pack_dir(fs_dir_t *dir, char *buf) {
+    memset(buf, 0, DIR_BLOCK_SIZE);
+
+    dir_block_t *block = (dir_block_t *)buf;
+    block->constant = DIR_BLOCK_CONSTANT;
+    block->next = dir->next == NULL ? 0 : dir->next->addr;
+    block->used = dir->used;
+
+    int offset = sizeof(dir_block_t);
+    fs_file_t *file;
+    for (file = dir->files; file != NULL; file = file->dir_next) {
+        dir_entry_t *entry = (dir_entry_t *)(buf + offset);
+        char *name = (char *)(entry + 1);
+        entry->len = file->entry_len;
+        entry->name_len = strlen(file->filename);
+        entry->flags = file->inline_data == NULL ? 0 : FILE_INLINE;
+        if (file->shared)
+            entry->flags |= FILE_SHARED;
+        entry->writeable = file->writeable;
+        entry->size = file->size;
+        entry->data_node = file->data_node;
+        memcpy(name, file->filename, entry->name_len + 1);
+        if (file->inline_data != NULL)
+            memcpy(name + entry->name_len + 1, file->inline_data, file->size);
+        offset += file->entry_len;
     }
+}
 
-    int rv = -4;
+/** @brief Writes the changed sectors of dirty directory blocks to disk.
+ *
+ *  Each block is repacked and compared with its last written copy, so an
+ *  update to one entry logs only the sectors it touched.  Must be called
+ *  with the filesystem lock held.
+ */
+static int flush_dirs() {
+    char *buf = malloc(DIR_BLOCK_SIZE);
+    if (buf == NULL)
+        return -1;
 
-    int prev_addr = 0;
-    int addr = superblock->file_node;
-    while (addr != 0) {
-        if (read_file_node(addr, file_node) < 0) {
-            addr = -5;
-            break;
-        }
-        if (!strncmp(file_node->filename, filename, MAX_EXECNAME_LEN)) {
-            rv = 0;
-            int next = file_node->next;
-            if (prev_addr == 0) {
-                superblock->file_node = next;
-                write_superblock(superblock);
-            } else {
-                if (read_file_node(prev_addr, file_node) < 0)
-                    addr = -6;
-                file_node->next = next;
-                if (write_file_node(prev_addr, file_node) < 0)
-                    addr = -7;
+    int rv = 0;
+
+    fs_dir_t *dir;
+    for (dir = fs.dirs; dir != NULL; dir = dir->next) {
+        if (!dir->dirty)
+            continue;
+        pack_dir(dir, buf);
+
+        bool flushed = true;
+        int i;
+        for (i = 0; i < DIR_BLOCK_SECTORS; i++) {
+            char *sector = buf + i * IDE_SECTOR_SIZE;
+            char *old = dir->buf + i * IDE_SECTOR_SIZE;
+            if (!memcmp(sector, old, IDE_SECTOR_SIZE))
+                continue;
+            if (journal_write(dir->addr + i, sector) < 0) {
+                flushed = false;
+                rv = -2;
+                continue;
             }
-            break;
+            memcpy(old, sector, IDE_SECTOR_SIZE);
         }
-
-        prev_addr = addr;
-        addr = file_node->next;
+        if (flushed)
+            dir->dirty = false;
     }
 
-    free(superblock);
+    free(buf);
 
-    return addr;
+    return rv;
 }
 
-static int add_free_node(unsigned long addr, int len, free_node_t *free_node) {
-    superblock_t *superblock = malloc(sizeof(superblock_t));
-    if (superblock == NULL)
-        return -1;
-    if (read_superblock(superblock) < 0) {
-        free(superblock);
-        return -2;
-    }
+/** @brief Logs the directory blocks, bitmap and superblock if dirty.
+ *
+ *  Must be called with the filesystem lock held.
+ */
+static int log_metadata() {
+    int rv = 0;
+    if (flush_dirs() < 0)
+        rv = -1;
+    if (flush_bitmap() < 0)
+        rv = -2;
+    if (flush_superblock() < 0)
+        rv = -3;
+    return rv;
+}
 
-    free_node->next = superblock->free_node;
-    free_node->len = len;
-    superblock->free_node = addr;
+/** @brief Releases the filesystem lock after a modifying operation.
+ *
+ *  Directory blocks, the bitmap and the superblock are logged once here
+ *  rather than on every allocation or file update made while the lock was
+ *  held.  The operation's journal transaction is left running, to be
+ *  committed by the writeback flusher or by a sync along with the
+ *  operations which follow it.
+ */
+static int unlock_fs() {
+    int rv = log_metadata();
+    mutex_unlock(&fs.lock);
+    return rv;
+}
 
-    if (write_superblock(superblock) < 0) {
-        free(superblock);
-        return -3;
+/** @brief Logs any dirty metadata and ends the running transaction.
+ *
+ *  Must be called with the filesystem lock held, which is released.
+ *
+ *  @param seq Memory to store the sequence number of the transaction to
+ *  commit.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int seal_fs(int *seq) {
+    int rv = log_metadata();
+    *seq = journal_seal();
+    mutex_unlock(&fs.lock);
+    return rv;
+}
+
+static int write_data_node(unsigned long addr, data_node_t *data_node) {
+    return journal_write(addr, (void *)data_node);
+}
+
+/** @brief Fills in a data node for a run of a file's data. */
+static void pack_data_node(data_node_t *data_node, int next, int start,
+                           int len, int written) {
+    data_node->next = next;
+    data_node->len = len;
+    data_node->start = start;
+    data_node->flags = written < len ? DATA_UNWRITTEN : 0;
+    data_node->written = written < len ? written : 0;
+}
+
+
+/** @brief Hashes a filename into a key for the name index. */
+static int name_hash(const char *filename) {
+    unsigned h = 5381;
+    while (*filename != '\0')
+        h = h * 33 + *filename++;
+    return (int)h;
+}
+
+static fs_file_t *lookup_file(const char *filename) {
+    fs_file_t *file;
+    if (hashtable_get(&fs.names, name_hash(filename), (void **)&file) < 0)
+        return NULL;
+
+    while (file != NULL && strcmp(file->filename, filename))
+        file = file->hash_next;
+
+    return file;
+}
+
+/** @brief Adds a file to the name index. */
+static int index_add(fs_file_t *file) {
+    int key = name_hash(file->filename);
+    fs_file_t *head;
+    if (hashtable_remove(&fs.names, key, (void **)&head) < 0)
+        head = NULL;
+    file->hash_next = head;
+    if (hashtable_add(&fs.names, key, (void *)file) < 0) {
+        if (head != NULL)
+            hashtable_add(&fs.names, key, (void *)head);
+        return -1;
     }
-    free(superblock);
-    if (write_free_node(addr, free_node) < 0)
-        return -4;
 
     return 0;
 }
 
-static int ls(char *buf, int count) {
-    superblock_t *superblock = malloc(sizeof(superblock_t));
-    if (superblock == NULL)
-        return -1;
-    if (read_superblock(superblock) < 0) {
-        free(superblock);
-        return -2;
+static void index_remove(fs_file_t *file) {
+    int key = name_hash(file->filename);
+    fs_file_t *head;
+    assert(hashtable_remove(&fs.names, key, (void **)&head) == 0);
+    if (head == file) {
+        head = file->hash_next;
+    } else {
+        fs_file_t *cur = head;
+        while (cur->hash_next != file)
+            cur = cur->hash_next;
+        cur->hash_next = file->hash_next;
     }
-    int addr = superblock->file_node;
-    free(superblock);
+    if (head != NULL)
+        assert(hashtable_add(&fs.names, key, (void *)head) == 0);
+}
 
-    file_node_t *file_node = malloc(sizeof(superblock_t));
-    if (file_node == NULL)
-        return -3;
+/** @brief Creates an in-memory file from a directory entry or file node.
+ *
+ *  @param filename The filename, which need not be NUL terminated.
+ *  @param name_len The length of the filename.
+ *  @param size The size of the file in bytes.
+ *  @param writeable Whether the file is writeable.
+ *  @param data_node The address of the first data node, or 0.
+ *  @param inline_data The file's inline data, or NULL if it has extents.
+ *  @return The file, or NULL if memory could not be allocated.
+ */
+static fs_file_t *new_file(const char *filename, int name_len, uint32_t size,
+                           int writeable, int data_node, char *inline_data) {
+    fs_file_t *file = malloc(sizeof(fs_file_t));
+    if (file == NULL)
+        return NULL;
 
-    int read_len = 0;
+    if (rwlock_init(&file->lock) < 0 ||
+        (file->filename = malloc(name_len + 1)) == NULL) {
+        free(file);
+        return NULL;
+    }
+    memcpy(file->filename, filename, name_len);
+    file->filename[name_len] = '\0';
 
-    while (addr != 0) {
-        if (read_file_node(addr, file_node) < 0) {
-            read_len = -4;
-            break;
+    file->dir = NULL;
+    file->entry_len = 0;
+    file->size = size;
+    file->writeable = writeable;
+    file->data_node = data_node;
+    file->inline_data = NULL;
+    if (inline_data != NULL) {
+        if ((file->inline_data = malloc(INLINE_MAX)) == NULL) {
+            free(file->filename);
+            free(file);
+            return NULL;
         }
-        int len = MIN(strlen(file_node->filename) + 1, count - read_len);
-        memcpy(buf + read_len, file_node->filename, len);
-        read_len += len;
-        if (read_len == count)
-            break;
-        addr = file_node->next;
+        memset(file->inline_data, 0, INLINE_MAX);
+        memcpy(file->inline_data, inline_data, MIN(size, INLINE_MAX));
     }
+    file->extents = NULL;
+    file->num_extents = 0;
+    file->max_extents = 0;
+    memset(&file->ra, 0, sizeof(fs_readahead_t));
+    file->data_gen = 0;
+    file->readers = 0;
+    file->refs = 0;
+    file->deleted = false;
+    file->shared = false;
 
-    free(file_node);
+    return file;
+}
 
-    return read_len;
+static void free_file(fs_file_t *file) {
+    free(file->inline_data);
+    free(file->ra.buf);
+    free(file->extents);
+    free(file->filename);
+    free(file);
 }
 
-int readfile(char *filename, char *buf, int count, int offset)
-{
-    if (!strcmp(filename, "."))
-        return ls(buf, count);
+/** @brief Gets the length of a file's directory entry.
+ *
+ *  @param file The file.
+ *  @param size The size of the file, which an inline file's entry holds.
+ *  @return The length of the entry in bytes.
+ */
+static int entry_len(fs_file_t *file, uint32_t size) {
+    int inline_len = file->inline_data == NULL ? 0 : size;
+    return DIR_ENTRY_LEN(strlen(file->filename), inline_len);
+}
 
-    char *kernel_buf = malloc(count * sizeof(char));
-    if (kernel_buf == NULL)
-        return -1;
+/** @brief Drops a file's cached extent map. */
+static void invalidate_extents(fs_file_t *file) {
+    free(file->extents);
+    file->extents = NULL;
+    file->num_extents = 0;
+    file->max_extents = 0;
+}
 
-    file_node_t *file_node = malloc(sizeof(file_node_t));
-    if (file_node == NULL) {
-        free(kernel_buf);
-        return -2;
-    }
-    if (get_file_node(filename, file_node) < 0) {
-        free(kernel_buf);
-        return -3;
+/** @brief Appends an extent to the end of a file's extent map. */
+static int push_extent(fs_file_t *file, int node, int start, int len,
+                       int written) {
+    if (file->num_extents == file->max_extents) {
+        int max = file->max_extents == 0 ? EXTENTS_INIT_SIZE :
+                                           2 * file->max_extents;
+        fs_extent_t *extents = realloc(file->extents,
+                                       max * sizeof(fs_extent_t));
+        if (extents == NULL)
+            return -1;
+        file->extents = extents;
+        file->max_extents = max;
     }
 
+    fs_extent_t *extent = &file->extents[file->num_extents];
+    extent->node = node;
+    extent->logical = 0;
+    if (file->num_extents > 0)
+        extent->logical = (extent - 1)->logical + (extent - 1)->len;
+    extent->start = start;
+    extent->len = len;
+    extent->written = written;
+    file->num_extents++;
+
+    return 0;
+}
+
+/** @brief Loads a file's extent map from its data node chain.
+ *
+ *  The map is kept until the file is deleted or an extend fails, so each
+ *  data node is read at most once.  Must be called with the filesystem
+ *  lock held.
+ *
+ *  @param file The file.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int load_extents(fs_file_t *file) {
+    if (file->extents != NULL || file->data_node == 0)
+        return 0;
+
     data_node_t *data_node = malloc(sizeof(data_node_t));
-    if (data_node == NULL) {
-        free(kernel_buf);
-        free(file_node);
-        return -4;
-    }
+    if (data_node == NULL)
+        return -1;
 
-    int read_len = 0;
+    int rv = 0;
 
-    int addr = file_node->data_node;
-    free(file_node);
+    int addr = file->data_node;
     while (addr != 0) {
         if (read_data_node(addr, data_node) < 0) {
-            read_len = -5;
+            rv = -2;
+            break;
+        }
+        int written = data_node->len;
+        if (data_node->flags & DATA_UNWRITTEN)
+            written = data_node->written;
+        if (push_extent(file, addr, data_node->start, data_node->len,
+                        written) < 0) {
+            rv = -3;
             break;
         }
+        addr = data_node->next;
+    }
 
-        int sector = data_node->start;
-        int extent_bytes = data_node->len * IDE_SECTOR_SIZE;
+    free(data_node);
 
-        // Skip entire extent
-        if (offset >= extent_bytes) {
-            offset -= extent_bytes;
-            addr = data_node->next;
-            continue;
-        }
+    if (rv < 0)
+        invalidate_extents(file);
 
-        // Read first sector
-        if (offset > 0) {
-            sector += offset / IDE_SECTOR_SIZE;
-            offset = offset - PREV_SECTOR(offset);
-        }
-        if (offset > 0) {
-            char tmp_buf[IDE_SECTOR_SIZE];
-            if (dma_read(sector, tmp_buf, 1) < 0) {
-                read_len = -6;
-                break;
-            }
-            int len = MIN(count, NEXT_SECTOR(offset) - offset);
-            memcpy(kernel_buf, tmp_buf + offset, len);
-            offset = 0;
-            read_len += len;
-            sector++;
-        }
+    return rv;
+}
 
-        // Read multiple sectors
-        if (count - read_len >= IDE_SECTOR_SIZE &&
-            sector < data_node->start + data_node->len) {
-            int sector_len = MIN((count - read_len) / IDE_SECTOR_SIZE, data_node->start + data_node->len - sector);
-            if (dma_read(sector, kernel_buf + read_len, sector_len) < 0) {
-                read_len = -7;
-                break;
-            }
-            read_len += sector_len * IDE_SECTOR_SIZE;
-            sector += sector_len;
-        }
+/** @brief Finds the extent holding a sector of a file.
+ *
+ *  @param file The file, whose extent map must be loaded.
+ *  @param sector The sector offset in the file.
+ *  @return The index of the extent, or the number of extents if the sector
+ *  is past the end of the file's data.
+ */
+static int find_extent(fs_file_t *file, int sector) {
+    int lo = 0;
+    int hi = file->num_extents;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        fs_extent_t *extent = &file->extents[mid];
+        if (sector < extent->logical)
+            hi = mid;
+        else if (sector >= extent->logical + extent->len)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+    return file->num_extents;
+}
 
-        // Read last sector
-        if (count - read_len > 0 &&
-            sector < data_node->start + data_node->len) {
-            char tmp_buf[IDE_SECTOR_SIZE];
-            if (dma_read(sector, tmp_buf, 1) < 0) {
-                read_len = -8;
-                break;
-            }
-            int len = count - read_len;
-            memcpy(kernel_buf + read_len, tmp_buf, len);
-            read_len += len;
-            sector++;
+/** @brief Marks a run of sectors used or free in the bitmap. */
+static void mark_sectors(int start, int len, bool used) {
+    int sector;
+    for (sector = start; sector < start + len; sector++) {
+        if (used)
+            fs.bitmap[sector / 8] |= 1 << (sector % 8);
+        else
+            fs.bitmap[sector / 8] &= ~(1 << (sector % 8));
+        fs.bitmap_dirty[sector / BITS_PER_SECTOR] = true;
+    }
+}
+
+/** @brief Removes a run from the free list. */
+static void unlink_free(fs_free_t *prev, fs_free_t *run) {
+    if (prev == NULL)
+        fs.free = run->next;
+    else
+        prev->next = run->next;
+    free(run);
+}
+
+/** @brief Returns a run of sectors to free space.
+ *
+ *  The run is merged with the free runs on either side of it, so that
+ *  deleting neighbouring extents leaves one large run behind.
+ *
+ *  @param start The first sector.
+ *  @param len The number of sectors.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int free_sectors(int start, int len) {
+    if (len <= 0)
+        return 0;
+
+    // Even if the free list cannot grow, the sectors are reclaimed on remount
+    mark_sectors(start, len, false);
+
+    // Data still cached for the sectors must not land after they are reused
+    writeback_discard(start, len);
+
+    fs_free_t *prev = NULL;
+    fs_free_t *next = fs.free;
+    while (next != NULL && next->start < start) {
+        prev = next;
+        next = next->next;
+    }
+
+    if (prev != NULL && prev->start + prev->len == start) {
+        prev->len += len;
+        if (next != NULL && prev->start + prev->len == next->start) {
+            prev->len += next->len;
+            unlink_free(prev, next);
         }
+        return 0;
+    }
 
-        if (read_len == count)
-            break;
+    if (next != NULL && start + len == next->start) {
+        next->start = start;
+        next->len += len;
+        return 0;
+    }
 
-        addr = data_node->next;
+    fs_free_t *run = malloc(sizeof(fs_free_t));
+    if (run == NULL)
+        return -1;
+    run->start = start;
+    run->len = len;
+    run->next = next;
+    if (prev == NULL)
+        fs.free = run;
+    else
+        prev->next = run;
+
+    return 0;
+}
+
+/** @brief Allocates the sectors directly following an extent.
+ *
+ *  Used to grow the tail extent of a file in place.  Succeeds only if a free
+ *  run starts exactly at addr.
+ *
+ *  @param addr The first sector wanted.
+ *  @param len The maximum number of sectors wanted.
+ *  @return The number of sectors allocated.
+ */
+static int alloc_at(int addr, int len) {
+    fs_free_t *prev = NULL;
+    fs_free_t *run = fs.free;
+    while (run != NULL && run->start < addr) {
+        prev = run;
+        run = run->next;
     }
 
-    if (read_len > 0)
-        memcpy(buf, kernel_buf, read_len);
+    if (run == NULL || run->start != addr)
+        return 0;
 
-    free(kernel_buf);
-    free(data_node);
+    int got = MIN(len, run->len);
+    run->start += got;
+    run->len -= got;
+    if (run->len == 0)
+        unlink_free(prev, run);
 
-    return read_len;
+    mark_sectors(addr, got, true);
+
+    return got;
 }
 
-int sizefile(char *filename)
-{
-    file_node_t *file_node = malloc(sizeof(file_node_t));
-    if (file_node == NULL)
-        return -2;
-    if (get_file_node(filename, file_node) < 0) {
-        free(file_node);
-        return -1;
+/** @brief Allocates a contiguous run of free sectors.
+ *
+ *  Takes the smallest free run which holds all len sectors so that files
+ *  stay in as few extents as possible.  If no run is large enough the largest
+ *  run is used and the caller must allocate the remainder separately.
+ *  Sectors are taken from the start of the run, so that the rest of the run
+ *  directly follows them and the extent can later grow into it.
+ *
+ *  @param len The number of sectors wanted.
+ *  @param min The smallest run worth allocating.
+ *  @param got Memory to store the number of sectors allocated.
+ *  @return The first allocated sector on success, negative error code
+ *  otherwise.
+ */
+static int alloc_extent(int len, int min, int *got) {
+    fs_free_t *best = NULL;
+    fs_free_t *best_prev = NULL;
+
+    fs_free_t *prev = NULL;
+    fs_free_t *run;
+    for (run = fs.free; run != NULL; prev = run, run = run->next) {
+        if (run->len < min)
+            continue;
+        if (best == NULL ||
+            (run->len >= len && (best->len < len || run->len < best->len)) ||
+            (best->len < len && run->len > best->len)) {
+            best = run;
+            best_prev = prev;
+        }
     }
 
-    free(file_node);
+    if (best == NULL)
+        return -1;
+
+    int take = MIN(len, best->len);
+    int start = best->start;
+    best->start += take;
+    best->len -= take;
+    if (best->len == 0)
+        unlink_free(best_prev, best);
+
+    mark_sectors(start, take, true);
 
-    return file_node->size;
+    *got = take;
+    return start;
 }
 
-int writefile(char *filename, char *buf, int count, int offset, int create)
-{
-    return -1;
+/** @brief Gets the number of files referencing a run of sectors.
+ *
+ *  Only runs which have been shared by a clone are kept in the table; any
+ *  other run belongs to a single file.
+ */
+static int run_refs(int start) {
+    void *refs;
+    if (hashtable_get(&fs.shared, start, &refs) < 0)
+        return 1;
+    return (int)refs;
 }
 
-int deletefile(char *filename)
-{
-    file_node_t *file_node = malloc(sizeof(file_node_t));
-    if (file_node == NULL)
+static int set_run_refs(int start, int refs) {
+    void *old;
+    if (hashtable_remove(&fs.shared, start, &old) < 0)
+        old = NULL;
+    if (hashtable_add(&fs.shared, start, (void *)refs) < 0) {
+        if (old != NULL)
+            hashtable_add(&fs.shared, start, old);
         return -1;
-    int file_addr = remove_file_node(filename, file_node);
-    if (file_addr < 0) {
-        free(file_node);
-        return -2;
     }
-    int data_addr = file_node->data_node;
-    free(file_node);
 
-    data_node_t *data_node = malloc(sizeof(data_node_t));
-    if (data_node == NULL)
-        return -4;
+    return 0;
+}
 
-    free_node_t *free_node = malloc(sizeof(data_node_t));
-    if (free_node == NULL) {
-        free(data_node);
-        return -5;
-    }
+/** @brief Adds a file's reference to a run of sectors. */
+static int ref_run(int start) {
+    return set_run_refs(start, run_refs(start) + 1);
+}
+
+/** @brief Drops a file's reference to a run of sectors.
+ *
+ *  The run is only freed once no file references it.
+ */
+static int put_run(int start, int len) {
+    int refs = run_refs(start);
+    if (refs > 1)
+        return set_run_refs(start, refs - 1);
 
-    add_free_node(file_addr, 1, free_node);
+    void *old;
+    hashtable_remove(&fs.shared, start, &old);
+    return free_sectors(start, len);
+}
 
+/** @brief Drops a file's references to the data nodes and data of its first
+ *  num extents.
+ */
+static int put_extents(fs_file_t *file, int num) {
     int rv = 0;
 
-    while (data_addr != 0) {
-        if (read_data_node(data_addr, data_node) < 0) {
-            rv = -7;
+    int i;
+    for (i = 0; i < num; i++) {
+        fs_extent_t *extent = &file->extents[i];
+        if (put_run(extent->node, 1) < 0 ||
+            put_run(extent->start, extent->len) < 0)
+            rv = -1;
+    }
+
+    return rv;
+}
+
+/** @brief Adds a reference to the data nodes and data of each of a file's
+ *  extents, for a clone sharing them.
+ */
+static int ref_extents(fs_file_t *file) {
+    int i;
+    for (i = 0; i < file->num_extents; i++) {
+        fs_extent_t *extent = &file->extents[i];
+        if (ref_run(extent->node) < 0)
+            break;
+        if (ref_run(extent->start) < 0) {
+            put_run(extent->node, 1);
             break;
         }
-        add_free_node(data_addr, 1, free_node);
-        add_free_node(data_node->start, data_node->len, free_node);
-        data_addr = data_node->next;
     }
 
-    free(data_node);
-    free(free_node);
+    if (i < file->num_extents) {
+        put_extents(file, i);
+        return -1;
+    }
+
+    return 0;
+}
+
+/** @brief Creates an in-memory directory block.
+ *
+ *  The block's copy of its last written contents starts zeroed, so the
+ *  first flush writes every sector which holds entries.
+ */
+static fs_dir_t *new_dir(int addr) {
+    fs_dir_t *dir = malloc(sizeof(fs_dir_t));
+    if (dir == NULL)
+        return NULL;
+
+    if ((dir->buf = malloc(DIR_BLOCK_SIZE)) == NULL) {
+        free(dir);
+        return NULL;
+    }
+    memset(dir->buf, 0, DIR_BLOCK_SIZE);
+
+    dir->addr = addr;
+    dir->used = sizeof(dir_block_t);
+    dir->dirty = false;
+    dir->files = NULL;
+    dir->next = NULL;
+
+    return dir;
+}
+
+/** @brief Adds a file to a directory block after prev, or first if prev is
+ *  NULL.
+ */
+static void dir_link(fs_dir_t *dir, fs_file_t *file, fs_file_t *prev,
+                     int len) {
+    file->dir = dir;
+    file->entry_len = len;
+    dir->used += len;
+    dir->dirty = true;
+
+    file->dir_prev = prev;
+    if (prev == NULL) {
+        file->dir_next = dir->files;
+        dir->files = file;
+    } else {
+        file->dir_next = prev->dir_next;
+        prev->dir_next = file;
+    }
+    if (file->dir_next != NULL)
+        file->dir_next->dir_prev = file;
+}
+
+/** @brief Finds the first directory block with room for an entry.
+ *
+ *  A new block is allocated and linked at the head of the directory if every
+ *  block is full.  Must be called with the filesystem lock held.
+ *
+ *  @param len The length of the entry.
+ *  @return The block, or NULL if no block could be allocated.
+ */
+static fs_dir_t *find_dir(int len) {
+    fs_dir_t *dir;
+    for (dir = fs.dirs; dir != NULL; dir = dir->next) {
+        if (dir->used + len <= DIR_BLOCK_SIZE)
+            return dir;
+    }
+
+    int got;
+    int addr = alloc_extent(DIR_BLOCK_SECTORS, DIR_BLOCK_SECTORS, &got);
+    if (addr < 0)
+        return NULL;
+    if ((dir = new_dir(addr)) == NULL) {
+        free_sectors(addr, got);
+        return NULL;
+    }
+    dir->next = fs.dirs;
+    fs.dirs = dir;
+    fs.superblock.dir = addr;
+    fs.superblock_dirty = true;
+
+    return dir;
+}
+
+/** @brief Gives a new file an entry in the directory. */
+static int dir_add(fs_file_t *file) {
+    int len = entry_len(file, file->size);
+    fs_dir_t *dir = find_dir(len);
+    if (dir == NULL)
+        return -1;
+
+    dir_link(dir, file, NULL, len);
+
+    return 0;
+}
+
+/** @brief Removes a file's entry from its directory block.
+ *
+ *  A block left empty is unlinked from the directory and freed.  Must be
+ *  called with the filesystem lock held.
+ *
+ *  @param file The file.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int dir_remove(fs_file_t *file) {
+    fs_dir_t *dir = file->dir;
+
+    if (file->dir_prev == NULL)
+        dir->files = file->dir_next;
+    else
+        file->dir_prev->dir_next = file->dir_next;
+    if (file->dir_next != NULL)
+        file->dir_next->dir_prev = file->dir_prev;
+    dir->used -= file->entry_len;
+    dir->dirty = true;
+    file->dir = NULL;
+
+    if (dir->files != NULL)
+        return 0;
+
+    if (fs.dirs == dir) {
+        fs.dirs = dir->next;
+        fs.superblock.dir = dir->next == NULL ? 0 : dir->next->addr;
+        fs.superblock_dirty = true;
+    } else {
+        fs_dir_t *prev = fs.dirs;
+        while (prev->next != dir)
+            prev = prev->next;
+        prev->next = dir->next;
+        prev->dirty = true;
+    }
+
+    int rv = free_sectors(dir->addr, DIR_BLOCK_SECTORS);
+    free(dir->buf);
+    free(dir);
+
+    return rv < 0 ? -1 : 0;
+}
+
+/** @brief Resizes a file's directory entry and marks it for writing.
+ *
+ *  An entry which no longer fits in its block is moved to one with room.
+ *  Inline files grow their entry before their data so that a failure
+ *  leaves the entry as it was.  Must be called with the filesystem lock
+ *  held.
+ *
+ *  @param file The file.
+ *  @param len The new length of the entry.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int dir_resize(fs_file_t *file, int len) {
+    fs_dir_t *dir = file->dir;
+    if (dir->used - file->entry_len + len <= DIR_BLOCK_SIZE) {
+        dir->used += len - file->entry_len;
+        file->entry_len = len;
+        dir->dirty = true;
+        return 0;
+    }
+
+    fs_dir_t *to = find_dir(len);
+    if (to == NULL)
+        return -1;
+
+    if (dir_remove(file) < 0)
+        return -2;
+    dir_link(to, file, NULL, len);
+
+    return 0;
+}
+
+/** @brief Allocates memory for the cached bitmap described by the superblock.
+ */
+static int alloc_bitmap() {
+    fs.bitmap = malloc(fs.superblock.bitmap_len * IDE_SECTOR_SIZE);
+    if (fs.bitmap == NULL)
+        return -1;
+
+    fs.bitmap_dirty = malloc(fs.superblock.bitmap_len * sizeof(bool));
+    if (fs.bitmap_dirty == NULL)
+        return -2;
+
+    int i;
+    for (i = 0; i < fs.superblock.bitmap_len; i++)
+        fs.bitmap_dirty[i] = false;
+
+    return 0;
+}
+
+/** @brief Reads the free space bitmap and builds the free list from it.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int load_bitmap() {
+    if (alloc_bitmap() < 0)
+        return -1;
+
+    int i;
+    for (i = 0; i < fs.superblock.bitmap_len; i++) {
+        if (dma_read(fs.superblock.bitmap + i,
+                     fs.bitmap + i * IDE_SECTOR_SIZE, 1) < 0)
+            return -2;
+    }
+
+    fs_free_t *tail = NULL;
+    int sector = 0;
+    while (sector < fs.superblock.sectors) {
+        if (SECTOR_USED(sector)) {
+            sector++;
+            continue;
+        }
+
+        fs_free_t *run = malloc(sizeof(fs_free_t));
+        if (run == NULL)
+            return -3;
+        run->start = sector;
+        while (sector < fs.superblock.sectors && !SECTOR_USED(sector))
+            sector++;
+        run->len = sector - run->start;
+        run->next = NULL;
+
+        if (tail == NULL)
+            fs.free = run;
+        else
+            tail->next = run;
+        tail = run;
+    }
+
+    return 0;
+}
+
+/** @brief Converts a free list filesystem to use a free space bitmap.
+ *
+ *  Images built by the old packer.py keep free space in a linked list of
+ *  free nodes.  The list is read once, merged into the in-memory free list,
+ *  and replaced by a bitmap allocated from the free space itself.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int convert_free_list() {
+    fs.superblock.sectors = ide_size();
+    fs.superblock.bitmap_len = SECTORS((fs.superblock.sectors + 7) / 8);
+    if (alloc_bitmap() < 0)
+        return -1;
+    memset(fs.bitmap, 0xFF, fs.superblock.bitmap_len * IDE_SECTOR_SIZE);
+
+    free_node_t *free_node = malloc(sizeof(free_node_t));
+    if (free_node == NULL)
+        return -2;
+
+    int rv = 0;
+
+    int nodes = 0;
+    int addr = fs.superblock.free_node;
+    while (addr != 0) {
+        if (nodes++ > fs.superblock.sectors ||
+            read_free_node(addr, free_node) < 0) {
+            rv = -3;
+            break;
+        }
+        if (free_sectors(addr, free_node->len) < 0) {
+            rv = -4;
+            break;
+        }
+        addr = free_node->next;
+    }
+
+    free(free_node);
+
+    if (rv < 0)
+        return rv;
+
+    int got;
+    int start = alloc_extent(fs.superblock.bitmap_len,
+                             fs.superblock.bitmap_len, &got);
+    if (start < 0)
+        return -5;
+
+    int i;
+    for (i = 0; i < fs.superblock.bitmap_len; i++)
+        fs.bitmap_dirty[i] = true;
+
+    fs.superblock.constant = FS_BITMAP_CONSTANT;
+    fs.superblock.free_node = 0;
+    fs.superblock.bitmap = start;
+    fs.superblock_dirty = true;
+
+    // Write the bitmap before the superblock which points to it
+    if (flush_bitmap() < 0)
+        return -6;
+
+    return flush_superblock();
+}
+
+/** @brief Reads the directory blocks and builds the name index from them.
+ *
+ *  Each block is read with a single transfer.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int load_dirs() {
+    fs_dir_t *tail = NULL;
+    int blocks = 0;
+    int addr = fs.superblock.dir;
+    while (addr != 0) {
+        fs_dir_t *dir;
+        if (blocks++ > fs.superblock.sectors / DIR_BLOCK_SECTORS ||
+            (dir = new_dir(addr)) == NULL)
+            return -1;
+        if (tail == NULL)
+            fs.dirs = dir;
+        else
+            tail->next = dir;
+        tail = dir;
+
+        if (dma_read(addr, dir->buf, DIR_BLOCK_SECTORS) < 0)
+            return -2;
+
+        dir_block_t *block = (dir_block_t *)dir->buf;
+        if (block->constant != DIR_BLOCK_CONSTANT ||
+            block->used < (int)sizeof(dir_block_t) ||
+            block->used > DIR_BLOCK_SIZE)
+            return -3;
+
+        fs_file_t *prev = NULL;
+        int offset = sizeof(dir_block_t);
+        while (offset + sizeof(dir_entry_t) <= block->used) {
+            dir_entry_t *entry = (dir_entry_t *)(dir->buf + offset);
+            char *name = (char *)(entry + 1);
+            int inline_len = entry->flags & FILE_INLINE ? entry->size : 0;
+            if (entry->name_len >= MAX_EXECNAME_LEN ||
+                inline_len > INLINE_MAX ||
+                entry->len < sizeof(dir_entry_t) + entry->name_len + 1 +
+                             inline_len ||
+                offset + entry->len > block->used)
+                return -4;
+
+            char *inline_data = NULL;
+            if (entry->flags & FILE_INLINE)
+                inline_data = name + entry->name_len + 1;
+
+            fs_file_t *file = new_file(name, entry->name_len, entry->size,
+                                       entry->writeable, entry->data_node,
+                                       inline_data);
+            if (file == NULL || index_add(file) < 0)
+                return -5;
+            file->shared = (entry->flags & FILE_SHARED) != 0;
+            dir_link(dir, file, prev, entry->len);
+            prev = file;
+
+            offset += entry->len;
+        }
+        dir->dirty = false;
+
+        addr = block->next;
+    }
+
+    return 0;
+}
+
+/** @brief Counts a flagged file's reference to a run of sectors at mount.
+ *
+ *  Unlike ref_run, the first reference found to a run counts once.
+ */
+static int count_ref(int start) {
+    void *refs;
+    if (hashtable_get(&fs.shared, start, &refs) < 0)
+        return set_run_refs(start, 1);
+    return set_run_refs(start, (int)refs + 1);
+}
+
+/** @brief Counts the references to the extents of files sharing them.
+ *
+ *  Reference counts are not kept on disk.  Every file which may share
+ *  extents is flagged in its directory entry, so only the extent maps of
+ *  those files are read to rebuild the counts.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int count_shared() {
+    fs_dir_t *dir;
+    for (dir = fs.dirs; dir != NULL; dir = dir->next) {
+        fs_file_t *file;
+        for (file = dir->files; file != NULL; file = file->dir_next) {
+            if (!file->shared)
+                continue;
+            if (load_extents(file) < 0)
+                return -1;
+
+            int i;
+            for (i = 0; i < file->num_extents; i++) {
+                if (count_ref(file->extents[i].node) < 0 ||
+                    count_ref(file->extents[i].start) < 0)
+                    return -2;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/** @brief Upgrades a file node chain to directory blocks.
+ *
+ *  Images built by the old packer.py keep each file's entry in a sector of
+ *  its own.  The chain is read once and its entries are packed into
+ *  directory blocks.
+ *  The file node sectors are freed only after every entry has been moved,
+ *  and the blocks, bitmap and superblock are committed together, so a crash
+ *  leaves either the old chain or the new directory.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int upgrade_file_nodes() {
+    file_node_t *file_node = malloc(sizeof(file_node_t));
+    if (file_node == NULL)
+        return -1;
+
+    int rv = 0;
+
+    int nodes = 0;
+    int addr = fs.superblock.file_node;
+    while (addr != 0) {
+        if (nodes++ > fs.superblock.sectors ||
+            read_file_node(addr, file_node) < 0) {
+            rv = -2;
+            break;
+        }
+
+        int len = 0;
+        while (len < MAX_EXECNAME_LEN - 1 && file_node->filename[len] != '\0')
+            len++;
+        char *inline_data = NULL;
+        if (file_node->flags & FILE_INLINE)
+            inline_data = file_node->inline_data;
+
+        fs_file_t *file = new_file(file_node->filename, len, file_node->size,
+                                   file_node->writeable, file_node->data_node,
+                                   inline_data);
+        if (file == NULL) {
+            rv = -3;
+            break;
+        }
+        if (index_add(file) < 0) {
+            free_file(file);
+            rv = -3;
+            break;
+        }
+        if (dir_add(file) < 0) {
+            index_remove(file);
+            free_file(file);
+            rv = -4;
+            break;
+        }
+
+        addr = file_node->next;
+    }
+
+    // Free the chain only once no entry can be lost
+    addr = fs.superblock.file_node;
+    while (rv == 0 && addr != 0) {
+        if (read_file_node(addr, file_node) < 0) {
+            rv = -5;
+            break;
+        }
+        free_sectors(addr, 1);
+        addr = file_node->next;
+    }
+
+    free(file_node);
+
+    if (rv < 0)
+        return rv;
+
+    fs.superblock.file_node = 0;
+    fs.superblock_dirty = true;
+
+    if (flush_dirs() < 0 || flush_bitmap() < 0 || flush_superblock() < 0)
+        return -6;
+
+    return journal_commit(journal_seq());
+}
+
+/** @brief Mounts the filesystem.
+ *
+ *  Reads the directory once and builds the in-memory name index, so that
+ *  looking up a file by name costs no disk I/O afterwards.  A filesystem
+ *  still using the file node chain is upgraded to directory blocks.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+int fs_mount()
+{
+    if (mutex_init(&fs.lock) < 0)
+        return -1;
+
+    if (hashtable_init(&fs.names, NAMES_HT_SIZE) < 0)
+        return -2;
+
+    if (hashtable_init(&fs.shared, REFS_HT_SIZE) < 0)
+        return -2;
+
+    fs.dirs = NULL;
+    fs.free = NULL;
+
+    if (cond_init(&fs.ra_cv) < 0)
+        return -3;
+    fs.ra_head = NULL;
+    fs.ra_tail = NULL;
+    fs.ra_current = NULL;
+    fs.ra_gen = 0;
+    fs.ra_thread = false;
+
+    if (cond_init(&fs.readers_cv) < 0)
+        return -3;
+    fs.io_ticks = 0;
+
+    if (writeback_init() < 0)
+        return -14;
+
+    if (read_superblock(&fs.superblock) < 0)
+        return -4;
+    fs.superblock_dirty = false;
+
+    // Replay the journal before reading any other metadata
+    if (fs.superblock.journal != 0) {
+        if (journal_mount(fs.superblock.journal,
+                          fs.superblock.journal_len) < 0)
+            return -10;
+        if (read_superblock(&fs.superblock) < 0)
+            return -4;
+    }
+
+    if (fs.superblock.constant == FS_MAGIC_CONSTANT) {
+        if (convert_free_list() < 0)
+            return -8;
+    } else if (load_bitmap() < 0) {
+        return -9;
+    }
+
+    if (fs.superblock.journal == 0) {
+        int got;
+        int start = alloc_extent(JOURNAL_LEN, JOURNAL_LEN, &got);
+        if (start < 0)
+            return -11;
+        fs.superblock.journal = start;
+        fs.superblock.journal_len = JOURNAL_LEN;
+        fs.superblock_dirty = true;
+        if (flush_bitmap() < 0 || flush_superblock() < 0)
+            return -12;
+        if (journal_mount(start, JOURNAL_LEN) < 0)
+            return -10;
+    }
+
+    if (fs.superblock.dir != 0) {
+        if (load_dirs() < 0)
+            return -6;
+    } else if (fs.superblock.file_node != 0 && upgrade_file_nodes() < 0) {
+        return -7;
+    }
+
+    if (count_shared() < 0)
+        return -13;
+
+    return 0;
+}
+
+static int ls(char *buf, int count) {
+    int read_len = 0;
+
+    mutex_lock(&fs.lock);
+    fs_dir_t *dir;
+    for (dir = fs.dirs; dir != NULL && read_len < count; dir = dir->next) {
+        fs_file_t *file;
+        for (file = dir->files; file != NULL && read_len < count;
+             file = file->dir_next) {
+            int len = MIN(strlen(file->filename) + 1, count - read_len);
+            memcpy(buf + read_len, file->filename, len);
+            read_len += len;
+        }
+    }
+    mutex_unlock(&fs.lock);
+
+    return read_len;
+}
+
+/** @brief Drops a file's readahead cache.
+ *
+ *  Any prefetch in progress for the file is discarded when it completes.
+ *  Must be called with the filesystem lock held.
+ */
+static void readahead_invalidate(fs_file_t *file) {
+    free(file->ra.buf);
+    file->ra.buf = NULL;
+    file->ra.len = 0;
+    file->ra.gen = ++fs.ra_gen;
+}
+
+/** @brief Copies the start of a read from a file's readahead cache.
+ *
+ *  @return The number of bytes copied.
+ */
+static int readahead_copy(fs_file_t *file, char *buf, int count, int offset) {
+    int start = file->ra.start * IDE_SECTOR_SIZE;
+    int end = start + file->ra.len * IDE_SECTOR_SIZE;
+    if (file->ra.len == 0 || offset < start || offset >= end)
+        return 0;
+
+    int len = MIN(count, end - offset);
+    memcpy(buf, file->ra.buf + offset - start, len);
+    return len;
+}
+
+/** @brief Updates a file's readahead state after a read.
+ *
+ *  A read which starts where the previous one ended is sequential.  Each
+ *  sequential read doubles the readahead window up to READAHEAD_MAX sectors,
+ *  and once less than half a window is left in the cache the next window is
+ *  queued for the readahead thread.  Any other read resets the window.
+ *  Must be called with the filesystem lock held.
+ */
+static void readahead_update(fs_file_t *file, int offset, int count) {
+    fs_readahead_t *ra = &file->ra;
+
+    if (offset != ra->next) {
+        ra->next = offset + count;
+        ra->window = 0;
+        return;
+    }
+    ra->next = offset + count;
+    ra->window = ra->window == 0 ? READAHEAD_MIN :
+                                   MIN(2 * ra->window, READAHEAD_MAX);
+
+    int sector = ra->next / IDE_SECTOR_SIZE;
+    int len = MIN(ra->window, (int)SECTORS(file->size) - sector);
+    if (!fs.ra_thread || ra->pending || len <= 0 ||
+        (sector >= ra->start &&
+         ra->start + ra->len - sector >= ra->window / 2))
+        return;
+
+    fs_ra_req_t *req = malloc(sizeof(fs_ra_req_t));
+    if (req == NULL)
+        return;
+    req->file = file;
+    req->gen = ra->gen;
+    req->start = sector;
+    req->len = len;
+    req->next = NULL;
+
+    if (fs.ra_tail == NULL)
+        fs.ra_head = req;
+    else
+        fs.ra_tail->next = req;
+    fs.ra_tail = req;
+    ra->pending = true;
+
+    cond_signal(&fs.ra_cv);
+}
+
+/** @brief Removes a file's queued readahead before the file is freed.
+ *
+ *  Must be called with the filesystem lock held.
+ */
+static void readahead_cancel(fs_file_t *file) {
+    fs_ra_req_t *prev = NULL;
+    fs_ra_req_t *req = fs.ra_head;
+    while (req != NULL) {
+        fs_ra_req_t *next = req->next;
+        if (req->file == file) {
+            if (prev == NULL)
+                fs.ra_head = next;
+            else
+                prev->next = next;
+            if (fs.ra_tail == req)
+                fs.ra_tail = prev;
+            free(req);
+        } else {
+            prev = req;
+        }
+        req = next;
+    }
+
+    if (fs.ra_current == file)
+        fs.ra_current = NULL;
+}
+
+/** @brief Reads whole sectors from disk into a buffer.
+ *
+ *  Reads the disk only, without the data still in the write-behind cache.
+ *  Kernel buffers are identity mapped and are read in a single transfer.
+ *  User buffers are read into directly, by translating their pages to
+ *  physical segments which a single command fills, even where a sector
+ *  straddles two pages.  A user buffer which is not word aligned is read
+ *  through a bounce buffer instead.  User buffers must be locked by the
+ *  caller so that their pages cannot be removed while the transfer is in
+ *  progress.
+ *
+ *  @param sector The first sector to read.
+ *  @param buf The buffer.
+ *  @param count The number of sectors to read.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int read_disk(int sector, char *buf, int count)
+{
+    if ((unsigned)buf < USER_MEM_START)
+        return dma_read(sector, buf, count);
+
+    // DMA requires a word aligned destination
+    if ((unsigned)buf & 1) {
+        for (; count > 0; sector++, buf += IDE_SECTOR_SIZE, count--) {
+            char tmp_buf[IDE_SECTOR_SIZE];
+            if (dma_read(sector, tmp_buf, 1) < 0)
+                return -3;
+            memcpy(buf, tmp_buf, IDE_SECTOR_SIZE);
+        }
+        return 0;
+    }
+
+    while (count > 0) {
+        int len = MIN(count, DMA_MAX_SECTORS);
+
+        // Physically contiguous pages share a segment
+        dma_seg_t segs[READ_MAX_SEGS];
+        int num_segs = 0;
+        int bytes = len * IDE_SECTOR_SIZE;
+        char *pos = buf;
+        while (bytes > 0) {
+            unsigned pa;
+            if (vm_lookup_pa(pos, &pa) < 0)
+                return -1;
+            int seg_len = MIN(bytes, PAGE_SIZE - ((unsigned)pos & ~PAGE_MASK));
+            if (num_segs > 0 &&
+                segs[num_segs - 1].pa + segs[num_segs - 1].len == pa) {
+                segs[num_segs - 1].len += seg_len;
+            } else {
+                segs[num_segs].pa = pa;
+                segs[num_segs].len = seg_len;
+                num_segs++;
+            }
+            pos += seg_len;
+            bytes -= seg_len;
+        }
+
+        if (dma_read_segs(sector, segs, num_segs, len) < 0)
+            return -2;
+
+        sector += len;
+        buf += len * IDE_SECTOR_SIZE;
+        count -= len;
+    }
+
+    return 0;
+}
+
+/** @brief Reads whole sectors of file data into a buffer.
+ *
+ *  The sectors are read from disk and overlaid with any newer data in the
+ *  write-behind cache.  If a flush finished in between, the disk may have
+ *  been read before the flush wrote it, so the sectors are read again.
+ *
+ *  @param sector The first sector to read.
+ *  @param buf The buffer.
+ *  @param count The number of sectors to read.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int read_sectors(int sector, char *buf, int count)
+{
+    while (1) {
+        unsigned flushes = writeback_flushes();
+        int rv = read_disk(sector, buf, count);
+        if (rv < 0)
+            return rv;
+        if (writeback_read(sector, buf, count, flushes) == 0)
+            return 0;
+    }
+}
+
+/** @brief Reads whole sectors of a file's extent into a buffer.
+ *
+ *  Sectors which were preallocated but never written are zeroed without
+ *  reading the disk.
+ *
+ *  @param extent The extent.
+ *  @param sector The first sector to read, which must lie in the extent.
+ *  @param buf The buffer.
+ *  @param count The number of sectors to read.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int read_extent(fs_extent_t *extent, int sector, char *buf,
+                       int count) {
+    int len = MAX(0, MIN(count, extent->start + extent->written - sector));
+    if (len > 0 && read_sectors(sector, buf, len) < 0)
+        return -1;
+
+    memset(buf + len * IDE_SECTOR_SIZE, 0, (count - len) * IDE_SECTOR_SIZE);
+
+    return 0;
+}
+
+/** @brief Opens a file.
+ *
+ *  The file is looked up once and stays valid until it is closed, even if
+ *  it is deleted meanwhile; its sectors are only freed on the last close.
+ *  A deleted file's sectors are leaked if the system stops while it is
+ *  still open.
+ *
+ *  @param filename The file name.
+ *  @return The open file, or NULL if it does not exist.
+ */
+fs_file_t *fs_open(const char *filename)
+{
+    mutex_lock(&fs.lock);
+    fs_file_t *file = lookup_file(filename);
+    if (file != NULL)
+        file->refs++;
+    mutex_unlock(&fs.lock);
+
+    return file;
+}
+
+/** @brief Takes another reference to an open file.
+ *
+ *  @param file The open file.
+ *  @return The file, which must be closed once more.
+ */
+fs_file_t *fs_dup(fs_file_t *file)
+{
+    mutex_lock(&fs.lock);
+    file->refs++;
+    mutex_unlock(&fs.lock);
+
+    return file;
+}
+
+/** @brief Gets the size of an open file. */
+int fs_size(fs_file_t *file)
+{
+    mutex_lock(&fs.lock);
+    int size = file->size;
+    mutex_unlock(&fs.lock);
+
+    return size;
+}
+
+/** @brief Reads from an open file.
+ *
+ *  Whole sectors are read directly into the caller's buffer; only the
+ *  partial sectors at either end of the read are copied through a bounce
+ *  buffer.  A user buffer must be locked by the caller, as the readfile
+ *  system call handler does.
+ *
+ *  The file's lock is held shared for the whole read, so that its data
+ *  cannot change or be moved underneath it, but the filesystem lock only
+ *  while the extents covering the read are looked up.  Reads of the same or
+ *  different files therefore transfer their data concurrently.
+ *
+ *  @param file The open file.
+ *  @param buf The buffer.
+ *  @param count The maximum number of bytes to read.
+ *  @param offset The offset in the file to start reading at.
+ *  @return The number of bytes read on success, negative error code
+ *  otherwise.
+ */
+int fs_pread(fs_file_t *file, char *buf, int count, int offset)
+{
+    if (count < 0 || offset < 0)
+        return -1;
+
+    rwlock_lock(&file->lock, RWLOCK_READ);
+    mutex_lock(&fs.lock);
+
+    fs.io_ticks = get_ticks();
+
+    // Never read past the end of the file
+    if (offset >= file->size || count == 0) {
+        mutex_unlock(&fs.lock);
+        rwlock_unlock(&file->lock);
+        return 0;
+    }
+    count = MIN(count, file->size - offset);
+
+    if (file->inline_data != NULL) {
+        memcpy(buf, file->inline_data + offset, count);
+        mutex_unlock(&fs.lock);
+        rwlock_unlock(&file->lock);
+        return count;
+    }
+
+    readahead_update(file, offset, count);
+
+    int cached = readahead_copy(file, buf, count, offset);
+    if (cached == count) {
+        mutex_unlock(&fs.lock);
+        rwlock_unlock(&file->lock);
+        return cached;
+    }
+    buf += cached;
+    count -= cached;
+    offset += cached;
+
+    if (load_extents(file) < 0) {
+        mutex_unlock(&fs.lock);
+        rwlock_unlock(&file->lock);
+        return -5;
+    }
+
+    // Copy out the extents covering the read so the lock can be dropped
+    int first = find_extent(file, offset / IDE_SECTOR_SIZE);
+    int last = find_extent(file, (offset + count - 1) / IDE_SECTOR_SIZE);
+    int num_extents = MIN(last + 1, file->num_extents) - first;
+    fs_extent_t *extents = NULL;
+    if (num_extents > 0) {
+        extents = malloc(num_extents * sizeof(fs_extent_t));
+        if (extents == NULL) {
+            mutex_unlock(&fs.lock);
+            rwlock_unlock(&file->lock);
+            return -4;
+        }
+        memcpy(extents, &file->extents[first],
+               num_extents * sizeof(fs_extent_t));
+    }
+    mutex_unlock(&fs.lock);
+
+    int read_len = 0;
+
+    int i;
+    for (i = 0; i < num_extents && read_len < count; i++) {
+        fs_extent_t *extent = &extents[i];
+        int pos = offset + read_len;
+        int sector = extent->start + pos / IDE_SECTOR_SIZE - extent->logical;
+        int end = extent->start + extent->len;
+        int sector_offset = pos - PREV_SECTOR(pos);
+
+        // Read first sector
+        if (sector_offset > 0) {
+            char tmp_buf[IDE_SECTOR_SIZE];
+            if (read_extent(extent, sector, tmp_buf, 1) < 0) {
+                read_len = -6;
+                break;
+            }
+            int len = MIN(count - read_len, IDE_SECTOR_SIZE - sector_offset);
+            memcpy(buf + read_len, tmp_buf + sector_offset, len);
+            read_len += len;
+            sector++;
+        }
+
+        // Read multiple sectors
+        if (count - read_len >= IDE_SECTOR_SIZE && sector < end) {
+            int sector_len = MIN((count - read_len) / IDE_SECTOR_SIZE,
+                                 end - sector);
+            if (read_extent(extent, sector, buf + read_len, sector_len) < 0) {
+                read_len = -7;
+                break;
+            }
+            read_len += sector_len * IDE_SECTOR_SIZE;
+            sector += sector_len;
+        }
+
+        // Read last sector
+        if (count - read_len > 0 && sector < end) {
+            char tmp_buf[IDE_SECTOR_SIZE];
+            if (read_extent(extent, sector, tmp_buf, 1) < 0) {
+                read_len = -8;
+                break;
+            }
+            int len = MIN(count - read_len, IDE_SECTOR_SIZE);
+            memcpy(buf + read_len, tmp_buf, len);
+            read_len += len;
+        }
+    }
+
+    free(extents);
+    rwlock_unlock(&file->lock);
+
+    if (read_len < 0)
+        return read_len;
+
+    return cached + read_len;
+}
+
+/** @brief Reads from a file.
+ *
+ *  @param filename The file name.
+ *  @param buf The buffer.
+ *  @param count The maximum number of bytes to read.
+ *  @param offset The offset in the file to start reading at.
+ *  @return The number of bytes read on success, negative error code
+ *  otherwise.
+ */
+int readfile(char *filename, char *buf, int count, int offset)
+{
+    if (!strcmp(filename, "."))
+        return ls(buf, count);
+
+    if (count < 0 || offset < 0)
+        return -1;
+
+    fs_file_t *file = fs_open(filename);
+    if (file == NULL)
+        return -3;
+
+    int rv = fs_pread(file, buf, count, offset);
+    fs_close(file);
+
+    return rv;
+}
+
+int sizefile(char *filename)
+{
+    int size = -1;
+
+    mutex_lock(&fs.lock);
+    fs_file_t *file = lookup_file(filename);
+    if (file != NULL)
+        size = file->size;
+    mutex_unlock(&fs.lock);
+
+    return size;
+}
+
+/** @brief Counts the extents holding a file's data.
+ *
+ *  @param filename The file.
+ *  @return The number of extents, 0 if the data is inline in the file node,
+ *  or a negative error code.
+ */
+int extentsfile(char *filename)
+{
+    int rv = -1;
+
+    mutex_lock(&fs.lock);
+    fs_file_t *file = lookup_file(filename);
+    if (file != NULL) {
+        if (file->inline_data != NULL)
+            rv = 0;
+        else if (load_extents(file) < 0)
+            rv = -2;
+        else
+            rv = file->num_extents;
+    }
+    mutex_unlock(&fs.lock);
+
+    return rv;
+}
+
+static fs_file_t *create_file(char *filename) {
+    // New files start out inline and empty
+    fs_file_t *file = new_file(filename, strlen(filename), 0, 1, 0, "");
+    if (file == NULL)
+        return NULL;
+
+    if (index_add(file) < 0) {
+        free_file(file);
+        return NULL;
+    }
+
+    if (dir_add(file) < 0) {
+        index_remove(file);
+        free_file(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+/** @brief Grows a file so that it holds at least sectors sectors.
+ *
+ *  The tail extent is grown in place when the sectors after it are free and
+ *  it is not shared with a clone.  Otherwise new extents are allocated with
+ *  their data node in the first sector, directly in front of the data.  The
+ *  file's extent map is kept up to date, and dropped if the extend fails
+ *  part way.
+ *
+ *  Sectors about to be written count as written at once.  Preallocated
+ *  sectors are left unwritten, as are sectors grown onto a tail which is
+ *  still partly unwritten.
+ */
+static int extend_file(fs_file_t *file, int sectors, bool unwritten) {
+    if (load_extents(file) < 0)
+        return -1;
+
+    int have = 0;
+    fs_extent_t *tail = NULL;
+    if (file->num_extents > 0) {
+        tail = &file->extents[file->num_extents - 1];
+        have = tail->logical + tail->len;
+    }
+
+    int need = sectors - have;
+    if (need <= 0)
+        return 0;
+
+    data_node_t *data_node = malloc(sizeof(data_node_t));
+    if (data_node == NULL)
+        return -2;
+    memset(data_node, 0, sizeof(data_node_t));
+
+    int rv = 0;
+
+    if (tail != NULL && run_refs(tail->start) == 1) {
+        int got = alloc_at(tail->start + tail->len, need);
+        if (got > 0 && journal_revoke(tail->start + tail->len, got) < 0)
+            rv = -8;
+        if (got > 0) {
+            if (!unwritten && tail->written == tail->len)
+                tail->written += got;
+            pack_data_node(data_node, 0, tail->start, tail->len + got,
+                           tail->written);
+            if (write_data_node(tail->node, data_node) < 0)
+                rv = -3;
+            tail->len += got;
+            need -= got;
+        }
+    }
+
+    while (rv == 0 && need > 0) {
+        int got;
+        int start = alloc_extent(need + 1, 2, &got);
+        if (start < 0) {
+            rv = -4;
+            break;
+        }
+
+        // Data is written in place, so the journal must not overwrite it
+        if (journal_revoke(start + 1, got - 1) < 0) {
+            rv = -8;
+            break;
+        }
+
+        if (tail == NULL) {
+            file->data_node = start;
+        } else {
+            pack_data_node(data_node, start, tail->start, tail->len,
+                           tail->written);
+            if (write_data_node(tail->node, data_node) < 0) {
+                rv = -5;
+                break;
+            }
+        }
+
+        int written = unwritten ? 0 : got - 1;
+        pack_data_node(data_node, 0, start + 1, got - 1, written);
+        if (write_data_node(start, data_node) < 0) {
+            rv = -6;
+            break;
+        }
+
+        if (push_extent(file, start, start + 1, got - 1, written) < 0) {
+            rv = -7;
+            break;
+        }
+        tail = &file->extents[file->num_extents - 1];
+        need -= tail->len;
+    }
+
+    free(data_node);
+
+    if (rv < 0)
+        invalidate_extents(file);
+
+    return rv;
+}
+
+/** @brief Writes to the allocated sectors of a file.
+ *
+ *  The file's extent map must be loaded and cover the write.  The data is
+ *  tied to transaction seq, as for writeback_write.
+ */
+static int write_data(fs_file_t *file, char *buf, int count, int offset,
+                      int seq) {
+    int write_len = 0;
+
+    int i;
+    for (i = find_extent(file, offset / IDE_SECTOR_SIZE);
+         i < file->num_extents && write_len < count; i++) {
+        fs_extent_t *extent = &file->extents[i];
+        int pos = offset + write_len;
+        int sector = extent->start + pos / IDE_SECTOR_SIZE - extent->logical;
+        int end = extent->start + extent->len;
+        int sector_offset = pos - PREV_SECTOR(pos);
+
+        // Write first sector
+        if (sector_offset > 0) {
+            char tmp_buf[IDE_SECTOR_SIZE];
+            if (read_sectors(sector, tmp_buf, 1) < 0) {
+                write_len = -3;
+                break;
+            }
+            int len = MIN(count - write_len, IDE_SECTOR_SIZE - sector_offset);
+            memcpy(tmp_buf + sector_offset, buf + write_len, len);
+            if (writeback_write(sector, tmp_buf, 1, seq) < 0) {
+                write_len = -4;
+                break;
+            }
+            write_len += len;
+            sector++;
+        }
+
+        // Write multiple sectors
+        if (count - write_len >= IDE_SECTOR_SIZE && sector < end) {
+            int sector_len = MIN((count - write_len) / IDE_SECTOR_SIZE,
+                                 end - sector);
+            if (writeback_write(sector, buf + write_len, sector_len,
+                                seq) < 0) {
+                write_len = -5;
+                break;
+            }
+            write_len += sector_len * IDE_SECTOR_SIZE;
+            sector += sector_len;
+        }
+
+        // Write last sector
+        if (count - write_len > 0 && sector < end) {
+            char tmp_buf[IDE_SECTOR_SIZE];
+            if (read_sectors(sector, tmp_buf, 1) < 0) {
+                write_len = -6;
+                break;
+            }
+            memcpy(tmp_buf, buf + write_len, count - write_len);
+            if (writeback_write(sector, tmp_buf, 1, seq) < 0) {
+                write_len = -7;
+                break;
+            }
+            write_len = count;
+        }
+    }
+
+    return write_len;
+}
+
+/** @brief Gives a file its own copy of the shared extents a write touches.
+ *
+ *  Extents which the write overlaps and which are still shared with a clone
+ *  are copied to newly allocated sectors.  Data nodes hold the links of a
+ *  file's chain, so each shared data node is replaced by one of the file's
+ *  own, while the data outside the write stays shared.  Nothing is changed
+ *  if an allocation or copy fails.
+ *
+ *  The data is copied without the filesystem lock, as for defrag_file, and
+ *  the new sectors are linked in once it is retaken.  Must be called with
+ *  the file's lock held exclusively, which keeps its extents from changing
+ *  meanwhile, and the filesystem lock held.
+ *
+ *  @param file The file.
+ *  @param offset The offset of the write.
+ *  @param count The length of the write.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int unshare_file(fs_file_t *file, int offset, int count) {
+    if (load_extents(file) < 0)
+        return -1;
+
+    int num_extents = file->num_extents;
+    if (num_extents == 0) {
+        file->shared = false;
+        return 0;
+    }
+
+    fs_extent_t *old = malloc(num_extents * sizeof(fs_extent_t));
+    fs_extent_t *extents = malloc(num_extents * sizeof(fs_extent_t));
+    char *buf = malloc(DEFRAG_CHUNK * IDE_SECTOR_SIZE);
+    data_node_t *data_node = malloc(sizeof(data_node_t));
+    if (old == NULL || extents == NULL || buf == NULL || data_node == NULL) {
+        free(old);
+        free(extents);
+        free(buf);
+        free(data_node);
+        return -2;
+    }
+    memcpy(old, file->extents, num_extents * sizeof(fs_extent_t));
+    memcpy(extents, file->extents, num_extents * sizeof(fs_extent_t));
+    memset(data_node, 0, sizeof(data_node_t));
+
+    int first = offset / IDE_SECTOR_SIZE;
+    int end = SECTORS(offset + count);
+
+    int rv = 0;
+    bool copy = false;
+
+    int i;
+    for (i = 0; i < num_extents && rv == 0; i++) {
+        fs_extent_t *extent = &extents[i];
+        int got;
+        if (first < extent->logical + extent->len && end > extent->logical &&
+            run_refs(extent->start) > 1) {
+            int start = alloc_extent(extent->len + 1, extent->len + 1, &got);
+            if (start < 0) {
+                rv = -3;
+                break;
+            }
+            extent->node = start;
+            extent->start = start + 1;
+            copy = true;
+
+            // Data is written in place, so the journal must not overwrite it
+            if (journal_revoke(extent->start, extent->len) < 0) {
+                rv = -4;
+                break;
+            }
+        } else if (run_refs(extent->node) > 1) {
+            int node = alloc_extent(1, 1, &got);
+            if (node < 0) {
+                rv = -6;
+                break;
+            }
+            extent->node = node;
+        }
+    }
+
+    if (rv == 0 && copy) {
+        mutex_unlock(&fs.lock);
+
+        // Sectors never written need not be copied
+        for (i = 0; i < num_extents && rv == 0; i++) {
+            if (extents[i].start == old[i].start)
+                continue;
+            int done;
+            for (done = 0; done < extents[i].written; done += DEFRAG_CHUNK) {
+                int len = MIN(DEFRAG_CHUNK, extents[i].written - done);
+                if (read_sectors(old[i].start + done, buf, len) < 0 ||
+                    dma_write(extents[i].start + done, buf, len) < 0) {
+                    rv = -5;
+                    break;
+                }
+            }
+        }
+
+        mutex_lock(&fs.lock);
+
+        // If the clone dropped the old sectors meanwhile they are the file's
+        // own, and are kept rather than freed under any mapped reads
+        for (i = 0; i < num_extents && rv == 0; i++) {
+            if (extents[i].start != old[i].start &&
+                run_refs(old[i].start) == 1) {
+                free_sectors(extents[i].start, extents[i].len);
+                extents[i].start = old[i].start;
+            }
+        }
+    }
+
+    // Rewrite every data node which moved or whose successor moved
+    for (i = 0; i < num_extents && rv == 0; i++) {
+        fs_extent_t *extent = &extents[i];
+        bool last = i == num_extents - 1;
+        if (extent->node == old[i].node &&
+            (last || (extent + 1)->node == old[i + 1].node))
+            continue;
+        pack_data_node(data_node, last ? 0 : (extent + 1)->node,
+                       extent->start, extent->len, extent->written);
+        if (write_data_node(extent->node, data_node) < 0)
+            rv = -7;
+    }
+
+    if (rv < 0) {
+        for (i = 0; i < num_extents; i++) {
+            fs_extent_t *extent = &extents[i];
+            if (extent->start != old[i].start)
+                free_sectors(extent->node, extent->len + 1);
+            else if (extent->node != old[i].node)
+                free_sectors(extent->node, 1);
+        }
+    } else {
+        memcpy(file->extents, extents, num_extents * sizeof(fs_extent_t));
+
+        bool shared = false;
+        for (i = 0; i < num_extents; i++) {
+            fs_extent_t *extent = &file->extents[i];
+            if (extent->node != old[i].node)
+                put_run(old[i].node, 1);
+            if (extent->start != old[i].start)
+                put_run(old[i].start, old[i].len);
+            if (run_refs(extent->start) > 1)
+                shared = true;
+        }
+        file->data_node = file->extents[0].node;
+        file->shared = shared;
+        file->dir->dirty = true;
+    }
+
+    free(old);
+    free(extents);
+    free(buf);
+    free(data_node);
+
+    return rv;
+}
+
+/** @brief Writes zeros to a run of sectors, with the filesystem lock held. */
+static int zero_sectors(int start, int len) {
+    if (len <= 0)
+        return 0;
+
+    char *buf = calloc(MIN(len, DEFRAG_CHUNK), IDE_SECTOR_SIZE);
+    if (buf == NULL)
+        return -1;
+
+    int rv = 0;
+
+    int done;
+    for (done = 0; done < len && rv == 0; done += DEFRAG_CHUNK) {
+        if (writeback_write(start + done, buf,
+                            MIN(DEFRAG_CHUNK, len - done), journal_seq()) < 0)
+            rv = -2;
+    }
+
+    free(buf);
+
+    return rv;
+}
+
+/** @brief Marks the preallocated sectors of a file up to a range written.
+ *
+ *  A file's unwritten sectors read as zeros, so those below the range, and
+ *  those in it which are not about to be overwritten whole, are zeroed on
+ *  disk before they count as written.  Unwritten sectors still shared with
+ *  a clone are unshared first.  Must be called with the file's lock held
+ *  exclusively, the filesystem lock held and the file's extent map covering
+ *  the range.
+ *
+ *  @param file The file.
+ *  @param offset The offset in the file of the range.
+ *  @param count The number of bytes in the range.
+ *  @param overwrite Whether the range is about to be written.
+ *  @return 1 if any sectors were zeroed, 0 if none were unwritten, negative
+ *  error code otherwise.
+ */
+static int fill_unwritten(fs_file_t *file, int offset, int count,
+                          bool overwrite) {
+    int end = SECTORS(offset + count);
+
+    // Sectors wholly overwritten need not be zeroed first
+    int skip = end;
+    int skip_end = end;
+    if (overwrite) {
+        skip = SECTORS(offset);
+        skip_end = MAX(skip, (offset + count) / IDE_SECTOR_SIZE);
+    }
+
+    int first = end;
+    int i;
+    for (i = 0; i < file->num_extents; i++) {
+        fs_extent_t *extent = &file->extents[i];
+        if (extent->written < extent->len) {
+            first = extent->logical + extent->written;
+            break;
+        }
+    }
+    if (first >= end)
+        return 0;
+
+    if (file->shared &&
+        unshare_file(file, first * IDE_SECTOR_SIZE,
+                     (end - first) * IDE_SECTOR_SIZE) < 0)
+        return -1;
+
+    data_node_t *data_node = malloc(sizeof(data_node_t));
+    if (data_node == NULL)
+        return -2;
+    memset(data_node, 0, sizeof(data_node_t));
+
+    int rv = 0;
+
+    for (; i < file->num_extents && rv == 0; i++) {
+        fs_extent_t *extent = &file->extents[i];
+        if (extent->logical >= end)
+            break;
+
+        int want = MIN(extent->len, end - extent->logical);
+        if (extent->written >= want)
+            continue;
+
+        // Zero the unwritten sectors around the part being overwritten
+        int lo = MAX(extent->written, skip - extent->logical);
+        int hi = MAX(lo, MIN(want, skip_end - extent->logical));
+        if (zero_sectors(extent->start + extent->written,
+                         MIN(lo, want) - extent->written) < 0 ||
+            zero_sectors(extent->start + hi, want - hi) < 0) {
+            rv = -3;
+            break;
+        }
+
+        extent->written = want;
+        bool last = i == file->num_extents - 1;
+        pack_data_node(data_node, last ? 0 : (extent + 1)->node,
+                       extent->start, extent->len, extent->written);
+        if (write_data_node(extent->node, data_node) < 0)
+            rv = -4;
+    }
+
+    free(data_node);
+
+    return rv < 0 ? rv : 1;
+}
+
+/** @brief Checks whether any sector in a range of a file is unwritten.
+ *
+ *  The file's extent map must be loaded.
+ */
+static bool range_unwritten(fs_file_t *file, int offset, int count) {
+    int first = offset / IDE_SECTOR_SIZE;
+    int end = SECTORS(offset + count);
+
+    int i;
+    for (i = 0; i < file->num_extents; i++) {
+        fs_extent_t *extent = &file->extents[i];
+        if (extent->written < extent->len &&
+            extent->logical + extent->written < end &&
+            extent->logical + extent->len > first)
+            return true;
+    }
+
+    return false;
+}
+
+/** @brief Moves a file's inline data out to an extent.
+ *
+ *  Called when a write would grow an inline file past INLINE_MAX bytes.
+ */
+static int uninline_file(fs_file_t *file) {
+    if (extend_file(file, SECTORS(file->size), false) < 0)
+        return -1;
+
+    if (file->size > 0 &&
+        write_data(file, file->inline_data, file->size, 0,
+                   journal_seq()) != file->size)
+        return -2;
+
+    free(file->inline_data);
+    file->inline_data = NULL;
+
+    return 0;
+}
+
+/** @brief Writes to a file.
+ *
+ *  Sectors are allocated with the filesystem lock held, but the data is
+ *  written without it, so that other files can be read and written
+ *  meanwhile.  Must be called with the file's lock held exclusively, which
+ *  keeps its extents from changing, and the filesystem lock held.
+ *
+ *  @return The number of bytes written on success, negative error code
+ *  otherwise.
+ */
+static int write_file(fs_file_t *file, char *buf, int count, int offset) {
+    // Writes may append to a file but not leave holes in it
+    if (!file->writeable || offset > file->size)
+        return -7;
+
+    if (count == 0)
+        return 0;
+
+    char *kernel_buf = malloc(count * sizeof(char));
+    if (kernel_buf == NULL)
+        return -8;
+    memcpy(kernel_buf, buf, count);
+
+    int rv = count;
+
+    readahead_invalidate(file);
+    file->data_gen++;
+    fs.io_ticks = get_ticks();
+
+    if (file->inline_data != NULL && offset + count <= INLINE_MAX) {
+        // Make room for the data in the directory entry before copying it
+        uint32_t size = MAX(file->size, offset + count);
+        if (dir_resize(file, entry_len(file, size)) < 0) {
+            rv = -14;
+        } else {
+            memcpy(file->inline_data + offset, kernel_buf, count);
+            file->size = size;
+        }
+    } else if (file->inline_data != NULL && uninline_file(file) < 0) {
+        rv = -13;
+    } else if (file->shared && unshare_file(file, offset, count) < 0) {
+        rv = -15;
+    } else if (extend_file(file, SECTORS(offset + count), false) < 0) {
+        rv = -9;
+    } else if (fill_unwritten(file, offset, count, true) < 0) {
+        rv = -16;
+    } else {
+        // The transaction may be sealed once the lock is dropped, so the
+        // data is tied to the one its metadata was logged in now
+        int seq = journal_seq();
+        mutex_unlock(&fs.lock);
+        int len = write_data(file, kernel_buf, count, offset, seq);
+        mutex_lock(&fs.lock);
+        if (len != count)
+            rv = -10;
+        else
+            file->size = MAX(file->size, offset + count);
+    }
+
+    // Inline data is written with the directory entry
+    if (dir_resize(file, entry_len(file, file->size)) < 0)
+        rv = -11;
+
+    free(kernel_buf);
+
+    return rv;
+}
+
+int writefile(char *filename, char *buf, int count, int offset, int create)
+{
+    if (count < 0 || offset < 0 || offset + count < offset)
+        return -1;
+
+    int name_len = strlen(filename);
+    if (name_len == 0 || name_len >= MAX_EXECNAME_LEN ||
+        !strcmp(filename, "."))
+        return -2;
+
+    mutex_lock(&fs.lock);
+
+    fs_file_t *file = lookup_file(filename);
+    if (file == NULL) {
+        if (!create) {
+            unlock_fs();
+            return -5;
+        }
+        if ((file = create_file(filename)) == NULL) {
+            unlock_fs();
+            return -6;
+        }
+    }
+
+    // Hold the file open while waiting for its lock
+    file->refs++;
+    mutex_unlock(&fs.lock);
+
+    int rv = fs_pwrite(file, buf, count, offset);
+
+    if (fs_close(file) < 0 && rv >= 0)
+        rv = -12;
+
+    return rv;
+}
+
+/** @brief Writes to an open file.
+ *
+ *  The file's lock is held exclusively, so reads of the file wait for the
+ *  whole write.  A file which has been deleted while open can no longer be
+ *  written.
+ *
+ *  @param file The open file.
+ *  @param buf The buffer.
+ *  @param count The number of bytes to write.
+ *  @param offset The offset in the file to start writing at.
+ *  @return The number of bytes written on success, negative error code
+ *  otherwise.
+ */
+int fs_pwrite(fs_file_t *file, char *buf, int count, int offset)
+{
+    if (count < 0 || offset < 0 || offset + count < offset)
+        return -1;
+
+    rwlock_lock(&file->lock, RWLOCK_WRITE);
+    mutex_lock(&fs.lock);
+
+    if (file->deleted) {
+        mutex_unlock(&fs.lock);
+        rwlock_unlock(&file->lock);
+        return -3;
+    }
+
+    int rv = write_file(file, buf, count, offset);
+
+    if (unlock_fs() < 0 && rv >= 0)
+        rv = -12;
+
+    rwlock_unlock(&file->lock);
+
+    return rv;
+}
+
+/** @brief Maps a range of a file with the file's lock held. */
+static int map_file(fs_file_t *file, int count, int offset, bool write,
+                    fs_run_t **runs, int *num_runs) {
+    if (count < 0 || offset < 0 || offset + count < offset)
+        return -1;
+
+    if (write && (offset % IDE_SECTOR_SIZE || count % IDE_SECTOR_SIZE))
+        return -2;
+
+    mutex_lock(&fs.lock);
+
+    fs.io_ticks = get_ticks();
+
+    if (write && (file->deleted || !file->writeable ||
+                  offset + count > file->size)) {
+        mutex_unlock(&fs.lock);
+        return -3;
+    }
+
+    *runs = NULL;
+    *num_runs = 0;
+    if (offset >= file->size || count == 0) {
+        mutex_unlock(&fs.lock);
+        return 0;
+    }
+    count = MIN(count, file->size - offset);
+
+    if (file->inline_data != NULL) {
+        mutex_unlock(&fs.lock);
+        return -4;
+    }
+
+    if (load_extents(file) < 0) {
+        mutex_unlock(&fs.lock);
+        return -5;
+    }
+
+    // Sectors shared with a clone must be copied before they are written,
+    // and the file's new data nodes committed along with the mapping
+    bool changed = false;
+    if (write && file->shared) {
+        if (unshare_file(file, offset, count) < 0) {
+            mutex_unlock(&fs.lock);
+            return -7;
+        }
+        changed = true;
+    }
+
+    // The transfer bypasses the extent map, so unwritten sectors must be
+    // zeroed on disk before being written.  Zeroing them changes the
+    // extents, which a reader may not do, so they are read through the
+    // filesystem instead.
+    if (write) {
+        int filled = fill_unwritten(file, offset, count, true);
+        if (filled < 0) {
+            unlock_fs();
+            return -8;
+        }
+        if (filled > 0)
+            changed = true;
+    } else if (range_unwritten(file, offset, count)) {
+        mutex_unlock(&fs.lock);
+        return -8;
+    }
+
+    int rv = count;
+
+    int sector = offset / IDE_SECTOR_SIZE;
+    int end = SECTORS(offset + count);
+    int first = find_extent(file, sector);
+    int last = find_extent(file, end - 1);
+    int num = MIN(last + 1, file->num_extents) - first;
+    fs_run_t *run = NULL;
+    if (num <= 0)
+        rv = -5;
+    else if ((run = malloc(num * sizeof(fs_run_t))) == NULL)
+        rv = -6;
+
+    if (rv > 0) {
+        int i;
+        for (i = 0; i < num; i++) {
+            fs_extent_t *extent = &file->extents[first + i];
+            int start = MAX(sector, extent->logical);
+            run[i].sector = extent->start + start - extent->logical;
+            run[i].len = MIN(end, extent->logical + extent->len) - start;
+        }
+
+        if (write) {
+            readahead_invalidate(file);
+            file->data_gen++;
+        }
+        file->readers++;
+
+        *runs = run;
+        *num_runs = num;
+    }
+
+    if (changed)
+        unlock_fs();
+    else
+        mutex_unlock(&fs.lock);
+
+    return rv;
+}
+
+/** @brief Maps a range of an open file to the sectors holding it.
+ *
+ *  Lets the range be transferred without the filesystem lock, as
+ *  asynchronous I/O does.  The runs cover the whole sectors the range lies
+ *  in.  Until the range is unmapped the file counts as being read, so the
+ *  defragmenter leaves its sectors alone.  Writes may only overwrite whole
+ *  sectors the file already holds; a write which grows the file, or to a
+ *  file whose data is inline, must go through fs_pwrite.  Likewise a read
+ *  of preallocated sectors not yet written must go through fs_pread.
+ *
+ *  @param file The open file.
+ *  @param count The number of bytes in the range.
+ *  @param offset The offset in the file of the range.
+ *  @param write Whether the range is to be written.
+ *  @param runs Set to the runs of sectors, which the caller must free.
+ *  @param num_runs Set to the number of runs.
+ *  @return The number of bytes in the range, which is shortened to end at
+ *  the end of the file, on success, negative error code otherwise.
+ */
+int fs_map(fs_file_t *file, int count, int offset, bool write,
+           fs_run_t **runs, int *num_runs)
+{
+    rwlock_lock(&file->lock, write ? RWLOCK_WRITE : RWLOCK_READ);
+    int rv = map_file(file, count, offset, write, runs, num_runs);
+
+    // The transfer bypasses the write-behind cache, so nothing cached for
+    // the range may be read past or later written over it
+    int i;
+    for (i = 0; rv > 0 && i < *num_runs; i++) {
+        if (writeback_flush((*runs)[i].sector, (*runs)[i].len) < 0) {
+            fs_unmap(file, write);
+            free(*runs);
+            rv = -9;
+        }
+    }
+    rwlock_unlock(&file->lock);
+
+    return rv;
+}
+
+/** @brief Unmaps a range of an open file mapped by fs_map.
+ *
+ *  Must only be called once no transfer to or from the range is still in
+ *  progress.
+ *
+ *  @param file The open file.
+ *  @param write Whether the range was mapped to be written.
+ */
+void fs_unmap(fs_file_t *file, bool write)
+{
+    mutex_lock(&fs.lock);
+
+    // Anything read from the file while the write was in flight is stale
+    if (write) {
+        readahead_invalidate(file);
+        file->data_gen++;
+    }
+
+    if (--file->readers == 0)
+        cond_broadcast(&fs.readers_cv);
+
+    mutex_unlock(&fs.lock);
+}
+
+/** @brief Frees a deleted file once it is no longer open.
+ *
+ *  Must be called with the filesystem lock held.
+ */
+static int release_file(fs_file_t *file) {
+    int rv = 0;
+
+    // Extents still shared with a clone are left to it
+    if (load_extents(file) < 0)
+        rv = -1;
+    else if (put_extents(file, file->num_extents) < 0)
+        rv = -2;
+
+    readahead_cancel(file);
+    free_file(file);
+
+    return rv;
+}
+
+/** @brief Closes an open file.
+ *
+ *  @param file The open file.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int fs_close(fs_file_t *file)
+{
+    mutex_lock(&fs.lock);
+
+    if (--file->refs > 0 || !file->deleted) {
+        mutex_unlock(&fs.lock);
+        return 0;
+    }
+
+    int rv = 0;
+
+    if (release_file(file) < 0)
+        rv = -1;
+
+    if (unlock_fs() < 0 && rv == 0)
+        rv = -2;
+
+    return rv;
+}
+
+/** @brief Deletes a file.
+ *
+ *  The file's lock is taken exclusively, so the delete waits for reads and
+ *  writes of the file already in progress.
+ *
+ *  @param filename The file name.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int deletefile(char *filename)
+{
+    fs_file_t *file = fs_open(filename);
+    if (file == NULL)
+        return -2;
+
+    rwlock_lock(&file->lock, RWLOCK_WRITE);
+    mutex_lock(&fs.lock);
+
+    // The file may have been deleted while its lock was awaited
+    if (file->deleted || load_extents(file) < 0) {
+        mutex_unlock(&fs.lock);
+        rwlock_unlock(&file->lock);
+        fs_close(file);
+        return -2;
+    }
+
+    index_remove(file);
+
+    int rv = 0;
+
+    if (dir_remove(file) < 0)
+        rv = -5;
+
+    // An open file keeps its sectors until it is closed
+    file->deleted = true;
+    rwlock_unlock(&file->lock);
+    if (--file->refs == 0 && release_file(file) < 0)
+        rv = -6;
+
+    if (unlock_fs() < 0 && rv == 0)
+        rv = -8;
+
+    return rv;
+}
+
+/** @brief Clones a file under a new name.
+ *
+ *  Must be called with the source file's lock held.
+ */
+static int clone_file(fs_file_t *src, char *to, int name_len) {
+    mutex_lock(&fs.lock);
+
+    if (src->deleted || lookup_file(to) != NULL) {
+        mutex_unlock(&fs.lock);
+        return -2;
+    }
+
+    if (src->inline_data == NULL && load_extents(src) < 0) {
+        mutex_unlock(&fs.lock);
+        return -3;
+    }
+
+    fs_file_t *file = new_file(to, name_len, src->size, 1, src->data_node,
+                               src->inline_data);
+    if (file == NULL) {
+        mutex_unlock(&fs.lock);
+        return -4;
+    }
+
+    if (ref_extents(src) < 0) {
+        free_file(file);
+        mutex_unlock(&fs.lock);
+        return -5;
+    }
+
+    if (index_add(file) < 0) {
+        put_extents(src, src->num_extents);
+        free_file(file);
+        mutex_unlock(&fs.lock);
+        return -6;
+    }
+
+    if (dir_add(file) < 0) {
+        index_remove(file);
+        put_extents(src, src->num_extents);
+        free_file(file);
+        unlock_fs();
+        return -7;
+    }
+
+    if (src->num_extents > 0) {
+        src->shared = true;
+        src->dir->dirty = true;
+        file->shared = true;
+
+        // Start the clone with the same extent map rather than rereading it
+        int i;
+        for (i = 0; i < src->num_extents; i++) {
+            fs_extent_t *extent = &src->extents[i];
+            if (push_extent(file, extent->node, extent->start,
+                            extent->len, extent->written) < 0) {
+                invalidate_extents(file);
+                break;
+            }
+        }
+    }
+
+    return unlock_fs() < 0 ? -8 : 0;
+}
+
+/** @brief Creates a file sharing the data of another.
+ *
+ *  The new file's directory entry points at the same data node chain, and
+ *  each data node and extent of the chain gains a reference, so a clone
+ *  costs no data I/O, only its directory entry.  Both files are flagged as
+ *  sharing extents, and either one copies an extent only once a write
+ *  touches it.  Inline data is copied with the entry.
+ *
+ *  @param from The name of the file to clone.
+ *  @param to The name of the new file.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int clonefile(char *from, char *to)
+{
+    int name_len = strlen(to);
+    if (name_len == 0 || name_len >= MAX_EXECNAME_LEN || !strcmp(to, "."))
+        return -1;
+
+    fs_file_t *src = fs_open(from);
+    if (src == NULL)
+        return -2;
+
+    // Keep the source's data from changing while its extents are shared
+    rwlock_lock(&src->lock, RWLOCK_READ);
+    int rv = clone_file(src, to, name_len);
+    rwlock_unlock(&src->lock);
+
+    if (fs_close(src) < 0 && rv == 0)
+        rv = -8;
+
+    return rv;
+}
+
+/** @brief Creates or grows a file, reserving its sectors up front.
+ *
+ *  The sectors are taken in as few contiguous runs as the free list
+ *  allows, so that the file never fragments as it is written.  They are
+ *  left unwritten: they read as zeros without any disk I/O until they are
+ *  written.  A file already at least size bytes long is left alone.
+ *
+ *  @param filename The name of the file.
+ *  @param size The size of the file in bytes.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int preallocfile(char *filename, int size)
+{
+    if (size < 0)
+        return -1;
+
+    int name_len = strlen(filename);
+    if (name_len == 0 || name_len >= MAX_EXECNAME_LEN ||
+        !strcmp(filename, "."))
+        return -2;
+
+    mutex_lock(&fs.lock);
+
+    fs_file_t *file = lookup_file(filename);
+    if (file == NULL && (file = create_file(filename)) == NULL) {
+        unlock_fs();
+        return -3;
+    }
+
+    // Hold the file open while waiting for its lock
+    file->refs++;
+    mutex_unlock(&fs.lock);
+
+    rwlock_lock(&file->lock, RWLOCK_WRITE);
+    mutex_lock(&fs.lock);
+
+    int rv = 0;
+
+    if (file->deleted) {
+        rv = -4;
+    } else if (!file->writeable) {
+        rv = -5;
+    } else if (size > file->size) {
+        // The tail's data node gains a link to the new sectors, so it must
+        // no longer be shared with a clone
+        if (file->inline_data != NULL && uninline_file(file) < 0) {
+            rv = -6;
+        } else if (file->shared &&
+                   unshare_file(file, file->size, size - file->size) < 0) {
+            rv = -11;
+        } else if (extend_file(file, SECTORS(size), true) < 0) {
+            rv = -7;
+        } else {
+            file->size = size;
+        }
+
+        if (dir_resize(file, entry_len(file, file->size)) < 0)
+            rv = -8;
+    }
+
+    if (unlock_fs() < 0 && rv == 0)
+        rv = -9;
+
+    rwlock_unlock(&file->lock);
+
+    if (fs_close(file) < 0 && rv == 0)
+        rv = -10;
+
+    return rv;
+}
+
+/** @brief Writes any cached filesystem data and metadata back to disk.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+int fs_sync()
+{
+    int seq;
+    mutex_lock(&fs.lock);
+    int rv = seal_fs(&seq);
+
+    // Data is written before the metadata which may point at it
+    if (writeback_sync() < 0)
+        rv = -4;
+    if (journal_commit(seq) < 0)
+        rv = -5;
+
+    return rv;
+}
+
+/** @brief Commits the metadata whose file data is already on disk.
+ *
+ *  Called by the writeback flusher after each pass, so that operations no
+ *  longer wait for their commit.  Only transactions no cached data is tied
+ *  to are committed, so data which has not aged is not forced out.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+int fs_commit()
+{
+    mutex_lock(&fs.lock);
+    int seq = writeback_oldest_seq() - 1;
+    if (seq >= journal_seq()) {
+        if (seal_fs(&seq) < 0)
+            return -1;
+    } else {
+        mutex_unlock(&fs.lock);
+    }
+
+    return journal_commit(seq);
+}
+
+/** @brief Writes an open file's data and metadata back to disk.
+ *
+ *  The file's own cached data is flushed.  Its metadata is logged in the
+ *  running journal transaction, which is committed along with the rest of
+ *  the filesystem's metadata once the data tied to it has been flushed.
+ *
+ *  @param file The open file.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int fs_fsync(fs_file_t *file)
+{
+    rwlock_lock(&file->lock, RWLOCK_READ);
+    mutex_lock(&fs.lock);
+
+    int rv = 0;
+    fs_extent_t *extents = NULL;
+    int num_extents = 0;
+    if (file->inline_data == NULL) {
+        if (load_extents(file) < 0) {
+            rv = -1;
+        } else if (file->num_extents > 0) {
+            num_extents = file->num_extents;
+            extents = malloc(num_extents * sizeof(fs_extent_t));
+            if (extents == NULL)
+                rv = -2;
+            else
+                memcpy(extents, file->extents,
+                       num_extents * sizeof(fs_extent_t));
+        }
+    }
+
+    int seq;
+    if (seal_fs(&seq) < 0 && rv == 0)
+        rv = -3;
+
+    int i;
+    for (i = 0; rv == 0 && i < num_extents; i++) {
+        if (writeback_flush(extents[i].start, extents[i].len) < 0)
+            rv = -4;
+    }
+    free(extents);
+
+    rwlock_unlock(&file->lock);
+
+    if (rv == 0 && journal_commit(seq) < 0)
+        rv = -5;
+
+    return rv;
+}
+
+/** @brief Prefetches queued readahead windows into file caches.
+ *
+ *  Run as a kernel thread, so that the next window of a sequentially read
+ *  file is read from disk while the reader consumes the current one.  A
+ *  window is discarded if its file was written or deleted meanwhile.
+ *
+ *  @return Does not return.
+ */
+void fs_readahead()
+{
+    mutex_lock(&fs.lock);
+    fs.ra_thread = true;
+    while (1) {
+        while (fs.ra_head == NULL)
+            cond_wait(&fs.ra_cv, &fs.lock);
+
+        fs_ra_req_t *req = fs.ra_head;
+        fs.ra_head = req->next;
+        if (fs.ra_head == NULL)
+            fs.ra_tail = NULL;
+
+        fs_file_t *file = req->file;
+        fs.ra_current = file;
+
+        int first = -1;
+        int num_extents = 0;
+        if (load_extents(file) == 0) {
+            first = find_extent(file, req->start);
+            int last = find_extent(file, req->start + req->len - 1);
+            num_extents = MIN(last + 1, file->num_extents) - first;
+        }
+
+        fs_extent_t *extents = NULL;
+        char *buf = NULL;
+        if (num_extents > 0) {
+            extents = malloc(num_extents * sizeof(fs_extent_t));
+            buf = malloc(req->len * IDE_SECTOR_SIZE);
+        }
+        if (extents == NULL || buf == NULL) {
+            free(extents);
+            free(buf);
+            file->ra.pending = false;
+            fs.ra_current = NULL;
+            free(req);
+            continue;
+        }
+        memcpy(extents, &file->extents[first],
+               num_extents * sizeof(fs_extent_t));
+        file->readers++;
+
+        mutex_unlock(&fs.lock);
+
+        int len = 0;
+        int i;
+        for (i = 0; i < num_extents && len < req->len; i++) {
+            int sector = req->start + len;
+            int count = MIN(req->len - len,
+                            extents[i].logical + extents[i].len - sector);
+            if (read_extent(&extents[i],
+                            extents[i].start + sector - extents[i].logical,
+                            buf + len * IDE_SECTOR_SIZE, count) < 0)
+                break;
+            len += count;
+        }
+        free(extents);
+
+        mutex_lock(&fs.lock);
+
+        if (fs.ra_current == file) {
+            if (--file->readers == 0)
+                cond_broadcast(&fs.readers_cv);
+            if (file->ra.gen == req->gen && len > 0) {
+                free(file->ra.buf);
+                file->ra.buf = buf;
+                file->ra.start = req->start;
+                file->ra.len = len;
+                buf = NULL;
+            }
+            file->ra.pending = false;
+        }
+        fs.ra_current = NULL;
+
+        free(buf);
+        free(req);
+    }
+}
+
+/** @brief Waits until there has been no foreground I/O for a while. */
+static void defrag_wait_idle() {
+    while (get_ticks() - fs.io_ticks < DEFRAG_IDLE_TICKS)
+        sleep(DEFRAG_IDLE_TICKS);
+}
+
+/** @brief Picks the next file to defragment.
+ *
+ *  The file in the most extents is picked, among those which fit in the
+ *  largest free run together with a data node.  Files sharing extents with
+ *  a clone are left alone, as moving them would duplicate the shared data.
+ *  Must be called with the filesystem lock held.
+ *
+ *  @return The file, or NULL if no file can be defragmented.
+ */
+static fs_file_t *defrag_pick() {
+    int largest = 0;
+    fs_free_t *run;
+    for (run = fs.free; run != NULL; run = run->next)
+        largest = MAX(largest, run->len);
+
+    fs_file_t *best = NULL;
+    fs_dir_t *dir;
+    for (dir = fs.dirs; dir != NULL; dir = dir->next) {
+        fs_file_t *file;
+        for (file = dir->files; file != NULL; file = file->dir_next) {
+            if (file->inline_data != NULL || file->shared ||
+                load_extents(file) < 0 || file->num_extents < 2)
+                continue;
+            fs_extent_t *tail = &file->extents[file->num_extents - 1];
+            if (tail->logical + tail->len + 1 > largest)
+                continue;
+            if (best == NULL || file->num_extents > best->num_extents)
+                best = file;
+        }
+    }
+
+    return best;
+}
+
+/** @brief Moves a file's data into a single new extent.
+ *
+ *  The data is copied without the filesystem lock, a chunk at a time, while
+ *  there is no foreground I/O.  The new extent is only swapped in if the
+ *  file was not written, deleted or cloned meanwhile, with the file's lock
+ *  held exclusively and once no mapped range or readahead is still using
+ *  the old extents.  The swap and the freeing of the old extents are logged
+ *  in the same transaction, so after a crash the file is in either its old
+ *  or its new extent.  Must be called with the filesystem lock held; it is
+ *  released while copying.
+ *
+ *  @param file The file.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int defrag_file(fs_file_t *file) {
+    int num_extents = file->num_extents;
+    fs_extent_t *tail = &file->extents[num_extents - 1];
+    int sectors = tail->logical + tail->len;
+
+    fs_extent_t *extents = malloc(num_extents * sizeof(fs_extent_t));
+    char *buf = malloc(DEFRAG_CHUNK * IDE_SECTOR_SIZE);
+    data_node_t *data_node = malloc(sizeof(data_node_t));
+    if (extents == NULL || buf == NULL || data_node == NULL) {
+        free(extents);
+        free(buf);
+        free(data_node);
+        return -1;
+    }
+    memcpy(extents, file->extents, num_extents * sizeof(fs_extent_t));
+
+    int rv = 0;
+
+    int got;
+    int start = alloc_extent(sectors + 1, sectors + 1, &got);
+    if (start < 0) {
+        rv = -2;
+    } else if (journal_revoke(start + 1, sectors) < 0) {
+        free_sectors(start, got);
+        rv = -3;
+    }
+    if (rv < 0) {
+        free(extents);
+        free(buf);
+        free(data_node);
+        return rv;
+    }
+
+    // Keep the file alive, and detect writes, while the lock is dropped
+    int gen = file->data_gen;
+    file->refs++;
+    mutex_unlock(&fs.lock);
+
+    // Unwritten sectors are copied as zeros, as the new extent is all written
+    int i;
+    for (i = 0; i < num_extents && rv == 0; i++) {
+        int done = 0;
+        while (done < extents[i].len) {
+            defrag_wait_idle();
+            int len = MIN(DEFRAG_CHUNK, extents[i].len - done);
+            if (read_extent(&extents[i], extents[i].start + done,
+                            buf, len) < 0 ||
+                dma_write(start + 1 + extents[i].logical + done,
+                          buf, len) < 0) {
+                rv = -4;
+                break;
+            }
+            done += len;
+        }
+    }
+
+    // Reads and writes of the file finish before its extents are swapped
+    rwlock_lock(&file->lock, RWLOCK_WRITE);
+    mutex_lock(&fs.lock);
+
+    while (rv == 0 && file->readers > 0)
+        cond_wait(&fs.readers_cv, &fs.lock);
+
+    if (rv == 0 && (file->deleted || file->shared || file->data_gen != gen))
+        rv = -5;
+
+    if (rv == 0) {
+        memset(data_node, 0, sizeof(data_node_t));
+        pack_data_node(data_node, 0, start + 1, sectors, sectors);
+        if (write_data_node(start, data_node) < 0)
+            rv = -6;
+    }
+
+    if (rv < 0) {
+        free_sectors(start, got);
+    } else {
+        for (i = 0; i < num_extents; i++) {
+            if (put_run(extents[i].node, 1) < 0 ||
+                put_run(extents[i].start, extents[i].len) < 0)
+                rv = -7;
+        }
+
+        file->data_node = start;
+        file->dir->dirty = true;
+        invalidate_extents(file);
+        push_extent(file, start, start + 1, sectors, sectors);
+        readahead_invalidate(file);
+    }
+
+    rwlock_unlock(&file->lock);
+    if (--file->refs == 0 && file->deleted)
+        release_file(file);
+
+    free(extents);
+    free(buf);
+    free(data_node);
 
     return rv;
-}
\ No newline at end of file
+}
+
+/** @brief Defragments files in the background.
+ *
+ *  Run as a kernel thread.  Whenever the disk has been idle for a while the
+ *  most fragmented file is copied into a single extent, until no file can
+ *  be improved, and the disk is then scanned again after a while.  The
+ *  extents of a file can be counted with extentsfile.
+ *
+ *  @return Does not return.
+ */
+void fs_defrag()
+{
+    while (1) {
+        defrag_wait_idle();
+
+        mutex_lock(&fs.lock);
+
+        fs_file_t *file = defrag_pick();
+        if (file == NULL) {
+            mutex_unlock(&fs.lock);
+            sleep(DEFRAG_PERIOD);
+            continue;
+        }
+
+        int rv = defrag_file(file);
+
+        unlock_fs();
+
+        // Back off from a file which is busy or cannot be moved
+        if (rv < 0)
+            sleep(DEFRAG_PERIOD);
+    }
+}
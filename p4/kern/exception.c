@@ -25,6 +25,9 @@
 #include <assert.h>
 #include <asm_common.h>
 
+/* Set in a page fault error code when the page was present */
+#define PF_ERR_PRESENT 0x1
+
 typedef struct {
     unsigned ret;
     void *arg;
@@ -126,7 +129,9 @@ static int call_user_handler(ureg_t *ureg)
 
 /**
  * @brief Handles all x86 exceptions.
- * @details If a user exception handler is registered, this will be called
+ * @details A page fault on a file mapping page which is not yet present is
+ * handled by filling the page, and the faulting instruction is retried.
+ * Otherwise, if a user exception handler is registered, this will be called
  * before killing a thread.
  * @param ureg The ureg containing the registers at the time of the exception.
  */
@@ -164,6 +169,11 @@ void exception_handler(ureg_t ureg)
         case IDT_XF:  /* SSE Floating Point Exception (Fault) */
             ureg.cr2 = 0;
         case IDT_PF:  /* Page Fault (Fault) */
+            // Other exceptions fall through to the user handler below
+            if (ureg.cause == IDT_PF && !(ureg.error_code & PF_ERR_PRESENT) &&
+                vm_map_fill((void *)ureg.cr2) == 0) {
+                return;
+            }
             call_user_handler(&ureg);
     }
 
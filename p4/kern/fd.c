@@ -0,0 +1,348 @@
+/** @file fd.c
+ *  @brief This file implements the file descriptor system calls.
+ *
+ *  A descriptor refers to an open file description holding the open file,
+ *  the mode it was opened with and the current offset.  Descriptors copied
+ *  by fork share their description, and so their offset, with the parent.
+ *  The file stays open until the last descriptor referring to it is closed.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug No known bugs.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include <kern_common.h>
+#include <mutex.h>
+#include <disk.h>
+#include <proc.h>
+#include <fd.h>
+
+/* Protects the reference counts of descriptions shared between processes */
+static mutex_t refs_lock;
+
+/** @brief Initializes file descriptors.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+int fd_init()
+{
+    if (mutex_init(&refs_lock) < 0)
+        return -1;
+
+    return 0;
+}
+
+/** @brief Initializes an empty descriptor table.
+ *
+ *  @param table The table.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int fd_table_init(fd_table_t *table)
+{
+    if (mutex_init(&table->lock) < 0)
+        return -1;
+
+    memset(table->fds, 0, sizeof(table->fds));
+
+    return 0;
+}
+
+static void hold_desc(fd_desc_t *desc) {
+    mutex_lock(&refs_lock);
+    desc->refs++;
+    mutex_unlock(&refs_lock);
+}
+
+/** @brief Drops a reference to a description, closing its file when the
+ *  last one is gone.
+ */
+static void release_desc(fd_desc_t *desc) {
+    mutex_lock(&refs_lock);
+    int refs = --desc->refs;
+    mutex_unlock(&refs_lock);
+
+    if (refs > 0)
+        return;
+
+    fs_close(desc->file);
+    free(desc);
+}
+
+/** @brief Looks up a descriptor of the invoking process.
+ *
+ *  The description is held so it stays valid if another thread closes the
+ *  descriptor; the caller must release it.
+ *
+ *  @return The description, or NULL if the descriptor is not open.
+ */
+static fd_desc_t *get_desc(int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FD)
+        return NULL;
+
+    fd_table_t *table = &getpcb()->fds;
+
+    mutex_lock(&table->lock);
+    fd_desc_t *desc = table->fds[fd];
+    if (desc != NULL)
+        hold_desc(desc);
+    mutex_unlock(&table->lock);
+
+    return desc;
+}
+
+/** @brief Gets the file open on a descriptor of the invoking process.
+ *
+ *  @param fd The descriptor.
+ *  @param flags Flags the descriptor must have been opened with.
+ *  @return A new reference to the file, which the caller must close, or NULL
+ *  if the descriptor is not open or lacks one of the flags.
+ */
+fs_file_t *fd_file(int fd, int flags)
+{
+    fd_desc_t *desc = get_desc(fd);
+    if (desc == NULL)
+        return NULL;
+
+    fs_file_t *file = NULL;
+    if ((desc->flags & flags) == flags)
+        file = fs_dup(desc->file);
+    release_desc(desc);
+
+    return file;
+}
+
+/** @brief Copies a descriptor table into a new process.
+ *
+ *  @param dst The empty table of the new process.
+ *  @param src The table to copy.
+ */
+void fd_table_copy(fd_table_t *dst, fd_table_t *src)
+{
+    mutex_lock(&src->lock);
+    int fd;
+    for (fd = 0; fd < MAX_OPEN_FD; fd++) {
+        if (src->fds[fd] != NULL)
+            hold_desc(src->fds[fd]);
+        dst->fds[fd] = src->fds[fd];
+    }
+    mutex_unlock(&src->lock);
+}
+
+/** @brief Closes every descriptor in a table.
+ *
+ *  @param table The table.
+ */
+void fd_table_clear(fd_table_t *table)
+{
+    int fd;
+    for (fd = 0; fd < MAX_OPEN_FD; fd++) {
+        mutex_lock(&table->lock);
+        fd_desc_t *desc = table->fds[fd];
+        table->fds[fd] = NULL;
+        mutex_unlock(&table->lock);
+
+        if (desc != NULL)
+            release_desc(desc);
+    }
+}
+
+/** @brief Opens a file.
+ *
+ *  Exactly one of O_RDONLY and O_RDWR must be given.  With O_CREAT, the
+ *  file is created if it does not exist.
+ *
+ *  @param filename The file name.
+ *  @param flags The mode to open the file with.
+ *  @return The lowest free descriptor on success, negative error code
+ *  otherwise.
+ */
+int openfile(const char *filename, int flags)
+{
+    int mode = flags & ~O_CREAT;
+    if (mode != O_RDONLY && mode != O_RDWR)
+        return -1;
+
+    fs_file_t *file = fs_open(filename);
+    if (file == NULL && (flags & O_CREAT)) {
+        if (writefile((char *)filename, NULL, 0, 0, 1) < 0)
+            return -2;
+        file = fs_open(filename);
+    }
+    if (file == NULL)
+        return -3;
+
+    fd_desc_t *desc = malloc(sizeof(fd_desc_t));
+    if (desc == NULL) {
+        fs_close(file);
+        return -4;
+    }
+
+    if (mutex_init(&desc->lock) < 0) {
+        free(desc);
+        fs_close(file);
+        return -5;
+    }
+    desc->file = file;
+    desc->flags = flags;
+    desc->offset = 0;
+    desc->refs = 1;
+
+    fd_table_t *table = &getpcb()->fds;
+
+    mutex_lock(&table->lock);
+    int fd;
+    for (fd = 0; fd < MAX_OPEN_FD; fd++) {
+        if (table->fds[fd] == NULL) {
+            table->fds[fd] = desc;
+            break;
+        }
+    }
+    mutex_unlock(&table->lock);
+
+    if (fd == MAX_OPEN_FD) {
+        release_desc(desc);
+        return -6;
+    }
+
+    return fd;
+}
+
+/** @brief Reads from a descriptor at its offset, advancing the offset.
+ *
+ *  @param fd The descriptor.
+ *  @param buf The buffer.
+ *  @param count The maximum number of bytes to read.
+ *  @return The number of bytes read, 0 at the end of the file, negative
+ *  error code otherwise.
+ */
+int readfd(int fd, char *buf, int count)
+{
+    fd_desc_t *desc = get_desc(fd);
+    if (desc == NULL)
+        return -1;
+
+    mutex_lock(&desc->lock);
+    int rv = fs_pread(desc->file, buf, count, desc->offset);
+    if (rv > 0)
+        desc->offset += rv;
+    mutex_unlock(&desc->lock);
+
+    release_desc(desc);
+
+    return rv;
+}
+
+/** @brief Writes to a descriptor at its offset, advancing the offset.
+ *
+ *  @param fd The descriptor, which must have been opened with O_RDWR.
+ *  @param buf The buffer.
+ *  @param count The number of bytes to write.
+ *  @return The number of bytes written on success, negative error code
+ *  otherwise.
+ */
+int writefd(int fd, char *buf, int count)
+{
+    fd_desc_t *desc = get_desc(fd);
+    if (desc == NULL)
+        return -1;
+
+    int rv = -2;
+
+    mutex_lock(&desc->lock);
+    if (desc->flags & O_RDWR) {
+        rv = fs_pwrite(desc->file, buf, count, desc->offset);
+        if (rv > 0)
+            desc->offset += rv;
+    }
+    mutex_unlock(&desc->lock);
+
+    release_desc(desc);
+
+    return rv;
+}
+
+/** @brief Moves the offset of a descriptor.
+ *
+ *  @param fd The descriptor.
+ *  @param offset The offset relative to whence.
+ *  @param whence SEEK_SET, SEEK_CUR or SEEK_END.
+ *  @return The new offset on success, negative error code otherwise.
+ */
+int seekfd(int fd, int offset, int whence)
+{
+    fd_desc_t *desc = get_desc(fd);
+    if (desc == NULL)
+        return -1;
+
+    mutex_lock(&desc->lock);
+
+    int base;
+    switch (whence) {
+    case SEEK_SET: base = 0; break;
+    case SEEK_CUR: base = desc->offset; break;
+    case SEEK_END: base = fs_size(desc->file); break;
+    default: base = -1; break;
+    }
+
+    int rv;
+    if (base < 0) {
+        rv = -2;
+    } else if (base + offset < 0 || (offset > 0 && base + offset < base)) {
+        rv = -3;
+    } else {
+        desc->offset = base + offset;
+        rv = desc->offset;
+    }
+
+    mutex_unlock(&desc->lock);
+
+    release_desc(desc);
+
+    return rv;
+}
+
+/** @brief Closes a descriptor.
+ *
+ *  @param fd The descriptor.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int closefd(int fd)
+{
+    if (fd < 0 || fd >= MAX_OPEN_FD)
+        return -1;
+
+    fd_table_t *table = &getpcb()->fds;
+
+    mutex_lock(&table->lock);
+    fd_desc_t *desc = table->fds[fd];
+    table->fds[fd] = NULL;
+    mutex_unlock(&table->lock);
+
+    if (desc == NULL)
+        return -2;
+
+    release_desc(desc);
+
+    return 0;
+}
+
+/** @brief Writes the data and metadata of a descriptor's file to disk.
+ *
+ *  @param fd The descriptor.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int syncfd(int fd)
+{
+    fd_desc_t *desc = get_desc(fd);
+    if (desc == NULL)
+        return -1;
+
+    int rv = fs_fsync(desc->file) < 0 ? -2 : 0;
+
+    release_desc(desc);
+
+    return rv;
+}
@@ -36,13 +36,16 @@ int fork()
 
     //copy the vm
     pd_t new_pd;
-    if (vm_copy(&new_pd, &new_pcb->alloc_pages) < 0) {
+    if (vm_copy(&new_pd, &new_pcb->alloc_pages, &new_pcb->mappings) < 0) {
         reap_pcb(new_pcb, NULL);
         reap_tcb(new_tcb);
         return -2;
     }
 
 
+    //share open files with the child
+    fd_table_copy(&new_pcb->fds, &old_pcb->fds);
+
     old_pcb->num_children++;
     linklist_add_head(&old_pcb->children, new_pcb, &new_pcb->pcb_listnode);
 
@@ -12,12 +12,30 @@
 #include <ide.h>
 #include <pci.h>
 #include <ide-config.h>
-#include <mutex.h>
 #include <scheduler.h>
 #include <ide.h>
+#include <asm_common.h>
+#include <ide-dma.h>
 
 #define PRD_EOT 0x8000
 
+/* DMA commands with 48-bit addresses and 16-bit sector counts */
+#define IDE_COMMAND_READ_DMA_EXT 0x25
+#define IDE_COMMAND_WRITE_DMA_EXT 0x35
+
+/* IDENTIFY words announcing, and enabling, the 48-bit feature set */
+#define IDENT_FEATURES_SUPPORTED 83
+#define IDENT_FEATURES_ENABLED 86
+#define IDENT_LBA48 (1 << 10)
+/* Polls of the status register before IDENTIFY is given up on */
+#define IDENT_TIMEOUT 100000
+
+/* Entries in the table describing a command, enough for the largest
+ * transfer of contiguous memory */
+#define DMA_MAX_PRDS 1024
+/* A table entry may not cross a 64K boundary, and moves at most 64K */
+#define PRD_BOUNDARY 0x10000
+
 typedef struct prd {
     uint32_t addr;
     uint16_t count;
@@ -27,35 +45,349 @@ typedef struct prd {
 static int ide_lba48_enabled = 0;
 static int bus_master_base;
 
-static mutex_t dma_mutex;
-static tcb_t *blocked_tcb;
-int block_flag = 1;
-static int dma_rv = 0;
+/* The transfers merged into the command in progress, linked in disk order,
+ * and those queued behind it, sorted by sector.  The queue is served in
+ * C-LOOK order: upwards from where the last command ended, then from the
+ * lowest sector again.  Only touched with interrupts disabled. */
+static dma_req_t *dma_current;
+static dma_req_t *dma_queue;
+static unsigned long dma_pos;
+static unsigned dma_seq;
+
+/* Transfers of at most dma_poll_sectors are polled for up to
+ * dma_poll_cycles when no other thread could run meanwhile */
+static int dma_poll_sectors = DMA_POLL_SECTORS;
+static unsigned dma_poll_cycles = DMA_POLL_CYCLES;
+static disk_stats_t dma_stats;
+
+/* The table describing the command in progress, aligned to its size so
+ * that it cannot cross a 64K boundary */
+static prd_t dma_prds[DMA_MAX_PRDS]
+    __attribute__((aligned(DMA_MAX_PRDS * sizeof(prd_t))));
+
+/** @brief Waits for the drive to clear a status bit, or to set one.
+ *
+ *  @return 0 on success, negative if the drive reports an error or does
+ *  not respond.
+ */
+static int ident_wait(int bit, bool set) {
+    int i;
+    for (i = 0; i < IDENT_TIMEOUT; i++) {
+        int status = inb(IDE_ALTSTATUS);
+        if (set && (status & IDE_STATUS_ERROR))
+            return -1;
+        if (!!(status & bit) == set)
+            return 0;
+    }
+    return -2;
+}
 
-int dma_init() {
-    if (mutex_init(&dma_mutex) < 0)
-        return -1;
+/** @brief Checks whether the drive can use 48-bit commands.
+ *
+ *  The 410 driver identifies the drive without exposing the result, so it
+ *  is identified again.  Called before any transfer is queued.
+ *
+ *  @return Whether LBA48 is supported and enabled.
+ */
+static bool dma_identify_lba48() {
+    outb(IDE_SELECT, IDE_SELECT_RSVD | IDE_SELECT_LBA);
+    if (ident_wait(IDE_STATUS_BUSY, false) < 0)
+        return false;
+
+    outb(IDE_COMMAND, IDE_COMMAND_IDENTIFY);
+    if (ident_wait(IDE_STATUS_BUSY, false) < 0 ||
+        ident_wait(IDE_STATUS_DRQ, true) < 0)
+        return false;
+
+    uint16_t ident[IDE_SECTOR_SIZE / 2];
+    int i;
+    for (i = 0; i < IDE_SECTOR_SIZE / 2; i++)
+        ident[i] = inw(IDE_DATA);
+
+    // Reading the status acknowledges the drive's interrupt
+    inb(IDE_STATUS);
+
+    return (ident[IDENT_FEATURES_SUPPORTED] & IDENT_LBA48) &&
+           (ident[IDENT_FEATURES_ENABLED] & IDENT_LBA48);
+}
 
+int dma_init() {
     bus_master_base = pci_find_bus_master_base();
 
+    ide_lba48_enabled = dma_identify_lba48();
+
     return 0;
 }
 
-void ide_block() {
-    blocked_tcb = gettcb();
-    block_flag = 0;
+/** @brief Gets the most sectors a single transfer can move.
+ *
+ *  @return DMA_MAX_SECTORS_LBA48 if the drive supports 48-bit commands,
+ *  DMA_MAX_SECTORS otherwise.
+ */
+int dma_max_sectors()
+{
+    return ide_lba48_enabled ? DMA_MAX_SECTORS_LBA48 : DMA_MAX_SECTORS;
+}
+
+/** @brief Completes each transfer merged into a command.
+ *
+ *  Each transfer records its result, runs its done function and wakes the
+ *  thread waiting for it.
+ */
+static void dma_complete(dma_req_t *req, int rv) {
+    while (req != NULL) {
+        // The done function may reuse the request
+        dma_req_t *next = req->next;
+        tcb_t *waiter = req->waiter;
+
+        req->rv = rv;
+        req->finished = 1;
+        if (req->done != NULL)
+            req->done(req, rv);
+        if (waiter != NULL)
+            make_runnable_kern(waiter, false);
+
+        req = next;
+    }
+}
+
+/** @brief Checks whether a queued transfer must wait for an older one.
+ *
+ *  Transfers are reordered freely unless they overlap and one of them
+ *  writes, so that a read never misses an earlier write nor a write lands
+ *  out of order.
+ */
+static bool dma_blocked(dma_req_t *req) {
+    dma_req_t *other;
+    for (other = dma_queue; other != NULL; other = other->next) {
+        if ((int)(other->seq - req->seq) < 0 &&
+            (other->write || req->write) &&
+            other->addr < req->addr + req->count &&
+            req->addr < other->addr + other->count)
+            return true;
+    }
+    return false;
+}
 
-    // Spin-wait if deschedule fails
-    while (deschedule_kern(&block_flag, false) < 0);
+/** @brief Removes a transfer from the queue. */
+static void dma_unlink(dma_req_t *req) {
+    dma_req_t **link = &dma_queue;
+    while (*link != req)
+        link = &(*link)->next;
+    *link = req->next;
+    req->next = NULL;
 }
 
-void ide_unblock() {
-    block_flag = 1;
-    make_runnable_kern(blocked_tcb, false);
+/** @brief Picks the next queued transfer to start, in C-LOOK order. */
+static dma_req_t *dma_pick() {
+    dma_req_t *req;
+    for (req = dma_queue; req != NULL; req = req->next) {
+        if (req->addr >= dma_pos && !dma_blocked(req))
+            return req;
+    }
+
+    // The oldest transfer is never blocked, so one is always found
+    for (req = dma_queue; req != NULL; req = req->next) {
+        if (!dma_blocked(req))
+            return req;
+    }
+    return NULL;
 }
 
-void ide_interrupt_handler()
+/** @brief Splits a transfer's memory into table entries.
+ *
+ *  Each segment is split wherever it crosses a 64K boundary.
+ *
+ *  @param req The transfer.
+ *  @param prds The entries to fill in, or NULL to only count them.
+ *  @return The number of entries.
+ */
+static int dma_fill_prds(dma_req_t *req, prd_t *prds) {
+    dma_seg_t seg = { .pa = req->pa, .len = req->count * IDE_SECTOR_SIZE };
+    dma_seg_t *segs = &seg;
+    int num_segs = 1;
+    if (req->segs != NULL) {
+        segs = req->segs;
+        num_segs = req->num_segs;
+    }
+
+    int num_prds = 0;
+    int i;
+    for (i = 0; i < num_segs; i++) {
+        unsigned pa = segs[i].pa;
+        int len = segs[i].len;
+        while (len > 0) {
+            int prd_len = MIN(len, PRD_BOUNDARY - (pa & (PRD_BOUNDARY - 1)));
+            if (prds != NULL) {
+                // A count of 0 stands for the whole 64K
+                prds[num_prds].addr = pa;
+                prds[num_prds].count = prd_len & (PRD_BOUNDARY - 1);
+                prds[num_prds].flags = 0;
+            }
+            num_prds++;
+            pa += prd_len;
+            len -= prd_len;
+        }
+    }
+
+    return num_prds;
+}
+
+/** @brief Finds a queued transfer which continues a command on disk. */
+static dma_req_t *dma_find_next(dma_req_t *first, int count, int num_prds) {
+    dma_req_t *req;
+    for (req = dma_queue; req != NULL; req = req->next) {
+        if (req->addr > first->addr + count)
+            break;
+        if (req->addr == first->addr + count && req->write == first->write &&
+            count + req->count <= dma_max_sectors() &&
+            num_prds + dma_fill_prds(req, NULL) <= DMA_MAX_PRDS &&
+            !dma_blocked(req))
+            return req;
+    }
+    return NULL;
+}
+
+/** @brief Starts the next queued transfer if the controller is idle.
+ *
+ *  Queued transfers which continue it on disk in the same direction are
+ *  merged into the same command, with their entries appended to the table
+ *  of the first.  Transfers
+ *  which cannot be started are completed with an error.  Must be called
+ *  with interrupts disabled.
+ */
+static void dma_start() {
+    while (dma_current == NULL && dma_queue != NULL) {
+        dma_req_t *req = dma_pick();
+        dma_unlink(req);
+
+        int count = req->count;
+        int num_prds = dma_fill_prds(req, dma_prds);
+        dma_req_t *last = req;
+        dma_req_t *next;
+        while ((next = dma_find_next(req, count, num_prds)) != NULL) {
+            dma_unlink(next);
+            last->next = next;
+            last = next;
+
+            num_prds += dma_fill_prds(next, &dma_prds[num_prds]);
+            count += next->count;
+        }
+        dma_prds[num_prds - 1].flags = PRD_EOT;
+
+        if (lba_setup(req->addr, count, ide_lba48_enabled) < 0) {
+            dma_complete(req, -3);
+            continue;
+        }
+
+        outd(bus_master_base + IDE_BM_PRDT, (unsigned)dma_prds);
+
+        int rd_wr = req->write ? 0 : BM_COM_RD_WR;
+        outb(bus_master_base + IDE_BM_COMMAND, rd_wr);
+
+        int bm_status = inb(bus_master_base + IDE_BM_STATUS);
+        outb(bus_master_base + IDE_BM_STATUS,
+            bm_status |  BM_STAT_INT | BM_STAT_ERR);
+
+        if (ide_lba48_enabled) {
+            outb(IDE_COMMAND, req->write ? IDE_COMMAND_WRITE_DMA_EXT :
+                                           IDE_COMMAND_READ_DMA_EXT);
+        } else {
+            outb(IDE_COMMAND,
+                 req->write ? IDE_COMMAND_WRITE_DMA : IDE_COMMAND_READ_DMA);
+        }
+
+        outb(bus_master_base + IDE_BM_COMMAND, rd_wr | BM_COM_START_STOP);
+
+        dma_current = req;
+        dma_pos = req->addr + count;
+    }
+}
+
+/** @brief Checks that the driver can carry out a transfer.
+ *
+ *  @return 0 if the transfer is valid, negative error code otherwise.
+ */
+static int dma_check(dma_req_t *req) {
+    if (!ide_present() || req->count <= 0 ||
+        req->count > dma_max_sectors() ||
+        (req->addr + req->count > ide_size()))
+        return -2;
+
+    // The memory must hold the sectors exactly, in word aligned pieces
+    if (req->segs != NULL) {
+        int len = 0;
+        int i;
+        for (i = 0; i < req->num_segs; i++) {
+            if (req->segs[i].len <= 0 || (req->segs[i].pa & 1) ||
+                (req->segs[i].len & 1))
+                return -3;
+            len += req->segs[i].len;
+        }
+        if (len != req->count * IDE_SECTOR_SIZE)
+            return -3;
+    } else if (req->pa & 1) {
+        return -3;
+    }
+
+    if (dma_fill_prds(req, NULL) > DMA_MAX_PRDS)
+        return -4;
+
+    return 0;
+}
+
+/** @brief Queues a transfer without waiting for it.
+ *
+ *  The transfer is started when the elevator reaches it, or merged into
+ *  the command of a transfer it continues on disk.  When it finishes its
+ *  result is recorded for dma_wait and its done function, if any, is called
+ *  with the result, usually from the IDE interrupt handler, so it must not
+ *  block.  The request must stay valid until then.  A transfer which cannot
+ *  be queued is finished at once with the error, without calling its done
+ *  function.
+ *
+ *  @param req The transfer.
+ *  @return 0 if the transfer was queued, negative error code otherwise.
+ */
+int dma_submit(dma_req_t *req)
 {
+    int rv = dma_check(req);
+    if (rv < 0) {
+        req->rv = rv;
+        req->finished = 1;
+        return rv;
+    }
+
+    req->finished = 0;
+    req->waiter = NULL;
+    req->submitted = rdtsc();
+
+    bool interrupts = interrupts_enabled();
+    disable_interrupts();
+
+    // Transfers of the same sector stay in arrival order
+    req->seq = dma_seq++;
+    dma_req_t **link = &dma_queue;
+    while (*link != NULL && (*link)->addr <= req->addr)
+        link = &(*link)->next;
+    req->next = *link;
+    *link = req;
+
+    dma_start();
+
+    if (interrupts)
+        enable_interrupts();
+
+    return 0;
+}
+
+/** @brief Finishes the command in progress if the controller is done.
+ *
+ *  Called from the interrupt handler, or when polling.  Reading the IDE
+ *  status clears the drive's interrupt, so an interrupt raised meanwhile
+ *  finds nothing to do.  Must be called with interrupts disabled.
+ */
+static void dma_finish() {
     int ide_status = inb(IDE_STATUS);
     int bm_status = inb(bus_master_base + IDE_BM_STATUS);
 
@@ -63,109 +395,258 @@ void ide_interrupt_handler()
     int bm_active = bm_status & BM_STAT_ACTIVE;
     
     // Ignore if no transfer started or transfer in progress
-    if (!block_flag && (bm_int || !bm_active)) {
+    if (dma_current != NULL && (bm_int || !bm_active)) {
+        int rv;
         // DMA error, Interrupt 0 and Active 0
         if (!bm_int) {
-            dma_rv = -1;
+            rv = -1;
         } else {
             // IDE device is busy or error
             if ((ide_status & IDE_STATUS_BUSY) ||
                 (ide_status & IDE_STATUS_ERROR)) {
-                dma_rv = -2;
+                rv = -2;
             // Transfer successful
             } else {
-                dma_rv = 0;
+                rv = 0;
             }
         }
 
         outb(bus_master_base + IDE_BM_COMMAND, bm_status & ~BM_COM_START_STOP);
 
-        ide_unblock();
+        dma_req_t *req = dma_current;
+        dma_current = NULL;
+        dma_complete(req, rv);
+
+        // Keep the controller busy without waiting for a thread to run
+        dma_start();
     }
+}
+
+void ide_interrupt_handler()
+{
+    dma_finish();
 
     pic_acknowledge(IDE_IRQ);
 }
 
-int dma_read(unsigned long addr, void *buf, int count)
+/** @brief Sets which transfers are waited for by polling.
+ *
+ *  @param max_sectors The largest transfer to poll for, or 0 to never poll.
+ *  @param max_cycles The processor cycles to poll for before sleeping.
+ */
+void dma_set_poll(int max_sectors, unsigned max_cycles)
 {
-    if ((unsigned)buf >= USER_MEM_START)
+    bool interrupts = interrupts_enabled();
+    disable_interrupts();
+
+    dma_poll_sectors = max_sectors;
+    dma_poll_cycles = max_cycles;
+
+    if (interrupts)
+        enable_interrupts();
+}
+
+/** @brief Copies the counters of how transfers were waited for. */
+void dma_get_stats(disk_stats_t *stats)
+{
+    bool interrupts = interrupts_enabled();
+    disable_interrupts();
+
+    *stats = dma_stats;
+
+    if (interrupts)
+        enable_interrupts();
+}
+
+/** @brief Sets which transfers are waited for by polling.
+ *
+ *  @param max_sectors The largest transfer to poll for, or 0 to never poll.
+ *  @param max_cycles The processor cycles to poll for before sleeping.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int diskpoll(int max_sectors, int max_cycles)
+{
+    if (max_sectors < 0 || max_cycles < 0)
         return -1;
 
-    if (!ide_present() || (addr + count > ide_size()))
+    dma_set_poll(max_sectors, max_cycles);
+    return 0;
+}
+
+/** @brief Copies the counters of how transfers were waited for.
+ *
+ *  @param stats The buffer to store the counters in.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int diskstats(disk_stats_t *stats)
+{
+    disk_stats_t copy;
+
+    if (buf_lock_rw(sizeof(disk_stats_t), (char *)stats) < 0)
         return -2;
 
-    mutex_lock(&dma_mutex);
+    dma_get_stats(&copy);
+    *stats = copy;
 
-    if (lba_setup(addr, count, ide_lba48_enabled) < 0) {
-        mutex_unlock(&dma_mutex);
-        return -3;
+    buf_unlock(sizeof(disk_stats_t), (char *)stats);
+    return 0;
+}
+
+/** @brief Polls the controller until a transfer finishes or time runs out.
+ *
+ *  Interrupts are enabled briefly between polls, so the timer and keyboard
+ *  are not held off.  Must be called with interrupts disabled, which they
+ *  are on return.
+ *
+ *  @return Whether the transfer finished.
+ */
+static bool dma_poll(dma_req_t *req) {
+    uint64_t start = rdtsc();
+    while (!req->finished) {
+        if (rdtsc() - start >= dma_poll_cycles)
+            return false;
+
+        if (inb(bus_master_base + IDE_BM_STATUS) & BM_STAT_INT)
+            dma_finish();
+
+        enable_interrupts();
+        disable_interrupts();
     }
+    return true;
+}
 
+/** @brief Waits for a queued transfer to finish.
+ *
+ *  Only one thread may wait for a transfer, and only once it has been
+ *  passed to dma_submit.  A small transfer is polled for first when no
+ *  other thread could use the processor, since sleeping and being woken
+ *  costs more than the transfer itself; if it takes too long the caller
+ *  sleeps until the interrupt as usual.  During kernel initialization there
+ *  is no other thread to run, so the caller spins until the interrupt
+ *  arrives instead.
+ *
+ *  @param req The transfer.
+ *  @return The result of the transfer, 0 on success, negative error code
+ *  otherwise.
+ */
+int dma_wait(dma_req_t *req)
+{
     disable_interrupts();
 
-    prd_t prd = {
-        .addr = (unsigned)buf,
-        .count = count * IDE_SECTOR_SIZE,
-        .flags = PRD_EOT
-    };
-    outd(bus_master_base + IDE_BM_PRDT, (unsigned)&prd);
+    if (req->finished) {
+        enable_interrupts();
+        return req->rv;
+    }
 
-    outb(bus_master_base + IDE_BM_COMMAND, BM_COM_RD_WR);
+    bool polled = false;
+    if (req->count <= dma_poll_sectors && !scheduler_others_runnable()) {
+        if (dma_poll(req)) {
+            dma_stats.polled++;
+            dma_stats.polled_cycles += rdtsc() - req->submitted;
+            enable_interrupts();
+            return req->rv;
+        }
+        polled = true;
+    }
 
-    int bm_status = inb(bus_master_base + IDE_BM_STATUS);
-    outb(bus_master_base + IDE_BM_STATUS,
-        bm_status |  BM_STAT_INT | BM_STAT_ERR);
+    req->waiter = gettcb();
+    if (deschedule_kern(&req->finished, false) < 0) {
+        disable_interrupts();
+        req->waiter = NULL;
+        enable_interrupts();
+        while (!*(volatile int *)&req->finished)
+            continue;
+    }
 
-    outb(IDE_COMMAND, IDE_COMMAND_READ_DMA);
+    disable_interrupts();
+    dma_stats.slept++;
+    dma_stats.slept_cycles += rdtsc() - req->submitted;
+    if (polled)
+        dma_stats.poll_misses++;
+    enable_interrupts();
 
-    outb(bus_master_base + IDE_BM_COMMAND, BM_COM_RD_WR | BM_COM_START_STOP);
+    return req->rv;
+}
 
-    ide_block();
-    int rv = dma_rv;
+/** @brief Transfers sectors, blocking until the transfer is done.
+ *
+ *  @param req The transfer, whose memory and sectors are filled in.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int dma_transfer(dma_req_t *req) {
+    req->done = NULL;
 
-    mutex_unlock(&dma_mutex);
+    if (dma_submit(req) < 0)
+        return -2;
 
-    return rv;
+    return dma_wait(req);
 }
 
-int dma_write(unsigned long addr, void *buf, int count)
-{
+/** @brief Transfers sectors to or from kernel memory.
+ *
+ *  Kernel memory is identity mapped, so the buffer is physically
+ *  contiguous.  Transfers larger than a command are split.
+ */
+static int dma_transfer_kernel(unsigned long addr, void *buf, int count,
+                               bool write) {
     if ((unsigned)buf >= USER_MEM_START)
         return -1;
 
     if (!ide_present() || (addr + count > ide_size()))
         return -2;
 
-    mutex_lock(&dma_mutex);
-
-    if (lba_setup(addr, count, ide_lba48_enabled) < 0) {
-        mutex_unlock(&dma_mutex);
-        return -3;
+    int max = dma_max_sectors();
+    int done;
+    for (done = 0; done < count; done += max) {
+        dma_req_t req = {
+            .addr = addr + done,
+            .pa = (unsigned)buf + done * IDE_SECTOR_SIZE,
+            .count = MIN(max, count - done),
+            .write = write
+        };
+        int rv = dma_transfer(&req);
+        if (rv < 0)
+            return rv;
     }
 
-    disable_interrupts();
-
-    prd_t prd = {
-        .addr = (unsigned)buf,
-        .count = count * IDE_SECTOR_SIZE,
-        .flags = PRD_EOT
-    };
-    outd(bus_master_base + IDE_BM_PRDT, (unsigned)&prd);
-
-    outb(bus_master_base + IDE_BM_COMMAND, 0);
-
-    int bm_status = inb(bus_master_base + IDE_BM_STATUS);
-    outb(bus_master_base + IDE_BM_STATUS,
-        bm_status |  BM_STAT_INT | BM_STAT_ERR);
-
-    outb(IDE_COMMAND, IDE_COMMAND_WRITE_DMA);
+    return 0;
+}
 
-    outb(bus_master_base + IDE_BM_COMMAND, BM_COM_START_STOP);
+int dma_read(unsigned long addr, void *buf, int count)
+{
+    return dma_transfer_kernel(addr, buf, count, false);
+}
 
-    ide_block();
-    int rv = dma_rv;
+/** @brief Reads sectors from disk into a list of physical segments.
+ *
+ *  Unlike dma_read, the destination need not be mapped in the kernel or
+ *  contiguous, so the locked pages of a user buffer may be filled by a
+ *  single command once they have been translated.
+ *
+ *  @param addr The first sector to read.
+ *  @param segs The segments, which must hold the sectors exactly and be
+ *  word aligned.
+ *  @param num_segs The number of segments.
+ *  @param count The number of sectors to read, at most dma_max_sectors().
+ *  @return 0 on success, negative error code otherwise.
+ */
+int dma_read_segs(unsigned long addr, dma_seg_t *segs, int num_segs,
+                  int count)
+{
+    if (!ide_present() || (addr + count > ide_size()))
+        return -2;
 
-    mutex_unlock(&dma_mutex);
+    dma_req_t req = {
+        .addr = addr,
+        .segs = segs,
+        .num_segs = num_segs,
+        .count = count,
+        .write = false
+    };
+    return dma_transfer(&req);
+}
 
-    return rv;
+int dma_write(unsigned long addr, void *buf, int count)
+{
+    return dma_transfer_kernel(addr, buf, count, true);
 }
@@ -0,0 +1,34 @@
+/** @file aio.h
+ *  @brief Prototypes for per-process asynchronous file I/O.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug No known bugs.
+ */
+
+#ifndef _AIO_H
+#define _AIO_H
+
+#include <linklist.h>
+#include <mutex.h>
+
+/* The most requests a process may have outstanding */
+#define AIO_MAX_REQS 64
+
+/* A process's outstanding asynchronous requests */
+typedef struct aio_table {
+    mutex_t lock;
+    linklist_t reqs;
+    int num_reqs;
+    int next_id;
+    /* Only touched with interrupts disabled, as requests complete from the
+     * IDE interrupt handler */
+    int completed;
+    linklist_t waiters;
+} aio_table_t;
+
+/* Asynchronous I/O functions */
+int aio_table_init(aio_table_t *table);
+void aio_table_clear(aio_table_t *table);
+
+#endif /* _AIO_H */
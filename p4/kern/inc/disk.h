@@ -0,0 +1,42 @@
+/** @file disk.h
+ *  @brief Prototypes for the disk filesystem.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug No known bugs.
+ */
+
+#ifndef _DISK_H
+#define _DISK_H
+
+#include <kern_common.h>
+
+/* An open file */
+typedef struct fs_file fs_file_t;
+
+/* A run of sectors holding part of a file */
+typedef struct fs_run {
+    int sector;
+    int len;
+} fs_run_t;
+
+/* Filesystem functions */
+int fs_mount();
+int fs_sync();
+int fs_commit();
+int fs_fsync(fs_file_t *file);
+void fs_readahead() NORETURN;
+void fs_defrag() NORETURN;
+
+/* Open file functions */
+fs_file_t *fs_open(const char *filename);
+fs_file_t *fs_dup(fs_file_t *file);
+int fs_pread(fs_file_t *file, char *buf, int count, int offset);
+int fs_pwrite(fs_file_t *file, char *buf, int count, int offset);
+int fs_size(fs_file_t *file);
+int fs_close(fs_file_t *file);
+int fs_map(fs_file_t *file, int count, int offset, bool write,
+           fs_run_t **runs, int *num_runs);
+void fs_unmap(fs_file_t *file, bool write);
+
+#endif /* _DISK_H */
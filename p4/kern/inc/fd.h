@@ -0,0 +1,39 @@
+/** @file fd.h
+ *  @brief Prototypes for per-process file descriptor tables.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug No known bugs.
+ */
+
+#ifndef _FD_H
+#define _FD_H
+
+#include <mutex.h>
+#include <disk.h>
+
+#define MAX_OPEN_FD 32
+
+/* An open file description, shared by the descriptors fork copies */
+typedef struct fd_desc {
+    fs_file_t *file;
+    int flags;
+    int offset;
+    int refs;
+    mutex_t lock;
+} fd_desc_t;
+
+/* A process's file descriptors */
+typedef struct fd_table {
+    mutex_t lock;
+    fd_desc_t *fds[MAX_OPEN_FD];
+} fd_table_t;
+
+/* File descriptor functions */
+int fd_init();
+int fd_table_init(fd_table_t *table);
+void fd_table_copy(fd_table_t *dst, fd_table_t *src);
+void fd_table_clear(fd_table_t *table);
+fs_file_t *fd_file(int fd, int flags);
+
+#endif /* _FD_H */
@@ -0,0 +1,101 @@
+/** @file fs_layout.h
+ *  @brief On-disk structures of the filesystem.
+ *
+ *  Shared by the kernel and the mkfs image builder, so this header must not
+ *  depend on any other kernel header.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug No known bugs.
+ */
+
+#ifndef _FS_LAYOUT_H
+#define _FS_LAYOUT_H
+
+#include <stdint.h>
+
+/* Equal to IDE_SECTOR_SIZE and MAX_EXECNAME_LEN */
+#define FS_SECTOR_SIZE 512
+#define FS_NAME_LEN 256
+
+#define SUPERBLOCK_ADDR 0
+
+/* Superblock constant of filesystems using the free space bitmap */
+#define FS_BITMAP_CONSTANT 0xde001338
+
+#define FILE_INLINE 0x1
+/* The file may share extents with a clone of it */
+#define FILE_SHARED 0x2
+#define INLINE_MAX (FS_SECTOR_SIZE - 20 - FS_NAME_LEN)
+
+/* Directory blocks are read and written with a single multi-sector transfer */
+#define DIR_BLOCK_CONSTANT 0x44495242
+#define DIR_BLOCK_SECTORS 8
+#define DIR_BLOCK_SIZE (DIR_BLOCK_SECTORS * FS_SECTOR_SIZE)
+
+/* The length of a directory entry, padded to keep entries word aligned */
+#define DIR_ENTRY_LEN(NAME_LEN, INLINE_LEN) \
+    ((sizeof(dir_entry_t) + (NAME_LEN) + 1 + (INLINE_LEN) + 3) & ~3)
+
+typedef struct superblock {
+    int constant;
+    int file_node;
+    int free_node;
+    int bitmap;
+    int bitmap_len;
+    int sectors;
+    int journal;
+    int journal_len;
+    int dir;
+    char padding[FS_SECTOR_SIZE - 36];
+} superblock_t;
+
+/* Legacy free list node, only read when converting to a bitmap */
+typedef struct free_node {
+    int next;
+    int len;
+    char padding[FS_SECTOR_SIZE - 8];
+} free_node_t;
+
+/* Legacy file node, only read when upgrading to directory blocks */
+typedef struct file_node {
+    int next;
+    char filename[FS_NAME_LEN];
+    uint32_t size;
+    int writeable;
+    int data_node;
+    int flags;
+    char inline_data[INLINE_MAX];
+} file_node_t;
+
+/* The start of a directory block, followed by packed directory entries */
+typedef struct dir_block {
+    int constant;
+    int next;
+    int used;
+} dir_block_t;
+
+/* A directory entry, followed by the filename and any inline data */
+typedef struct dir_entry {
+    uint16_t len;
+    uint16_t name_len;
+    uint16_t flags;
+    uint16_t writeable;
+    uint32_t size;
+    int data_node;
+} dir_entry_t;
+
+/* The data node's run has sectors from "written" on which were preallocated
+ * but never written, and read as zeros */
+#define DATA_UNWRITTEN 0x1
+
+typedef struct data_node {
+    int next;
+    int len;
+    int start;
+    int flags;
+    int written;
+    char padding[FS_SECTOR_SIZE - 20];
+} data_node_t;
+
+#endif /* _FS_LAYOUT_H */
@@ -37,6 +37,7 @@ void swexn_int(void *esp3, swexn_handler_t eip, void *arg, ureg_t *newureg);
 /* Memory management */
 int new_pages_int(void * addr, int len);
 int remove_pages_int(void * addr);
+int mapfile_int(void *addr, int len, int fd, int offset);
 
 /* Console I/O */
 int readline_int(int size, char *buf);
@@ -51,6 +52,23 @@ int sizefile_int(const char *filename);
 int writefile_int(const char *filename, char *buf, int count, int offset,
                  int create);
 int deletefile_int(const char *filename);
+int clonefile_int(const char *from, const char *to);
+int preallocfile_int(const char *filename, int size);
+int extentsfile_int(const char *filename);
+int diskpoll_int(int max_sectors, int max_cycles);
+int diskstats_int(disk_stats_t *stats);
+
+/* File descriptors */
+int openfile_int(const char *filename, int flags);
+int readfd_int(int fd, char *buf, int count);
+int writefd_int(int fd, char *buf, int count);
+int seekfd_int(int fd, int offset, int whence);
+int closefd_int(int fd);
+int syncfd_int(int fd);
+int aioread_int(int fd, char *buf, int count, int offset);
+int aiowrite_int(int fd, char *buf, int count, int offset);
+int aiopoll_int(aio_result_t *results, int count);
+int aiowait_int(aio_result_t *results, int count);
 
 /* Miscellaneous */
 void halt_int();
@@ -0,0 +1,62 @@
+/** @file ide-dma.h
+ *  @brief Prototypes for DMA transfers beyond those in the 410 IDE driver.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug No known bugs.
+ */
+
+#ifndef _IDE_DMA_H
+#define _IDE_DMA_H
+
+#include <kern_common.h>
+#include <syscall.h>
+
+/* The most sectors a single transfer can move on any drive */
+#define DMA_MAX_SECTORS 256
+/* The most sectors a single transfer can move on a drive with LBA48 */
+#define DMA_MAX_SECTORS_LBA48 65536
+
+/* Default limits for waiting on a transfer by polling the controller */
+#define DMA_POLL_SECTORS 8
+#define DMA_POLL_CYCLES 200000
+
+/* A physically contiguous piece of a transfer's memory, in bytes */
+typedef struct dma_seg {
+    unsigned pa;
+    int len;
+} dma_seg_t;
+
+/* A queued transfer, completed from the IDE interrupt handler.  Its memory
+ * is the segments if there are any, or else count sectors at pa.  The done
+ * function may be NULL if the submitter waits for the transfer instead.
+ * The fields from rv on belong to the driver. */
+typedef struct dma_req {
+    unsigned long addr;
+    unsigned pa;
+    dma_seg_t *segs;
+    int num_segs;
+    int count;
+    bool write;
+    void (*done)(struct dma_req *req, int rv);
+    void *data;
+    int rv;
+    int finished;
+    struct tcb *waiter;
+    uint64_t submitted;
+    unsigned seq;
+    struct dma_req *next;
+} dma_req_t;
+
+/* DMA functions */
+int dma_max_sectors();
+int dma_read_segs(unsigned long addr, dma_seg_t *segs, int num_segs,
+                  int count);
+int dma_submit(dma_req_t *req);
+int dma_wait(dma_req_t *req);
+void dma_set_poll(int max_sectors, unsigned max_cycles);
+void dma_get_stats(disk_stats_t *stats);
+int diskpoll(int max_sectors, int max_cycles);
+int diskstats(disk_stats_t *stats);
+
+#endif /* _IDE_DMA_H */
@@ -0,0 +1,27 @@
+/** @file journal.h
+ *  @brief Prototypes for the filesystem metadata journal.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug No known bugs.
+ */
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <kern_common.h>
+
+/* Sectors reserved for the journal when a filesystem is first mounted */
+#define JOURNAL_LEN 1024
+
+/* Journal functions */
+int journal_mount(int start, int len);
+int journal_write(int addr, void *buf);
+int journal_read(int addr, void *buf);
+int journal_revoke(int start, int len);
+int journal_seq();
+int journal_seal();
+int journal_commit(int seq);
+void journal_checkpointer() NORETURN;
+
+#endif /* _JOURNAL_H */
@@ -16,6 +16,8 @@
 #include <mutex.h>
 #include <vm.h>
 #include <rwlock.h>
+#include <fd.h>
+#include <aio.h>
 
 #define KERNEL_STACK_SIZE (2 * PAGE_SIZE)
 
@@ -63,6 +65,9 @@ typedef struct pcb {
     linklist_t vanished_procs;
     listnode_t pcb_listnode;
     hashtable_t alloc_pages;
+    linklist_t mappings;
+    fd_table_t fds;
+    aio_table_t aio;
 } pcb_t;
 
 /* Thread control block */
@@ -75,6 +80,7 @@ typedef struct tcb {
     listnode_t scheduler_listnode;
     int sleep_flag;
     bool user_descheduled;
+    struct fs_file *exec_file;
 } tcb_t;
 
 extern tcb_t *cur_tcb;
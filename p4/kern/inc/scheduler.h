@@ -19,6 +19,7 @@ void scheduler_tick(unsigned ticks);
 int context_switch(tcb_t *tcb);
 int deschedule_kern(int *flag, bool user);
 int make_runnable_kern(tcb_t *tcb, bool user);
+bool scheduler_others_runnable();
 
 
 #endif /* _SCHEDULER_INIT_H */
@@ -11,6 +11,8 @@
 
 #include <kern_common.h>
 #include <memlock.h>
+#include <linklist.h>
+#include <hashtable.h>
 
 #define PTE_PRESENT 0x1
 #define PTE_RW 0x2
@@ -26,18 +28,29 @@ typedef unsigned pte_t;
 typedef pde_t* pd_t;
 typedef pte_t* pt_t;
 
+/* A read-only private file mapping, filled a page at a time on fault */
+typedef struct vm_mapping {
+    void *base;
+    int len;
+    struct fs_file *file;
+    int offset;
+    listnode_t listnode;
+} vm_mapping_t;
+
 extern memlock_t vm_memlock;
 
 /* Virtual memory functions */
 int vm_init();
 int vm_new_pd();
-int vm_copy(pd_t *new_pd, hashtable_t *new_alloc_pages);
+int vm_copy(pd_t *new_pd, hashtable_t *new_alloc_pages,
+  linklist_t *new_mappings);
 void vm_clear();
 void vm_destroy();
 void vm_read_only();
 void vm_read_write(void *va);
 void vm_super(void *va);
 void vm_user(void *va);
+int vm_lookup_pa(void *va, unsigned *pa);
 bool vm_check_flags(pd_t pd, void *va, unsigned reqflags,
   unsigned badflags);
 bool vm_check_flags_len(pd_t pd, void *base, int len, unsigned reqflags,
@@ -51,6 +64,8 @@ void vm_unlock(void *va);
 void vm_unlock_len(void *base, int len);
 void vm_phys_write(unsigned pa, unsigned val);
 unsigned vm_phys_read(unsigned pa);
+int vm_map_fill(void *va);
+void vm_map_fill_len(void *base, int len);
 
 
 #endif /* _VM_H */
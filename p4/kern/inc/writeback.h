@@ -0,0 +1,26 @@
+/** @file writeback.h
+ *  @brief Prototypes for the write-behind cache of file data.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug No known bugs.
+ */
+
+#ifndef _WRITEBACK_H
+#define _WRITEBACK_H
+
+#include <kern_common.h>
+
+/* Write-behind functions */
+int writeback_init();
+int writeback_write(int sector, void *buf, int count, int seq);
+unsigned writeback_flushes();
+int writeback_read(int sector, void *buf, int count, unsigned flushes);
+int writeback_flush(int start, int len);
+int writeback_sync();
+int writeback_flush_seq(int seq);
+int writeback_oldest_seq();
+void writeback_discard(int start, int len);
+void writeback_flusher() NORETURN;
+
+#endif /* _WRITEBACK_H */
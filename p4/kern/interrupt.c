@@ -91,6 +91,7 @@ int idt_init()
     idt_add_desc(GETTID_INT, gettid_int, IDT_TRAP, IDT_DPL_USER);
     idt_add_desc(NEW_PAGES_INT, new_pages_int, IDT_TRAP, IDT_DPL_USER);
     idt_add_desc(REMOVE_PAGES_INT, remove_pages_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(MAPFILE_INT, mapfile_int, IDT_TRAP, IDT_DPL_USER);
     idt_add_desc(SLEEP_INT, sleep_int, IDT_TRAP, IDT_DPL_USER);
     idt_add_desc(READLINE_INT, readline_int, IDT_TRAP, IDT_DPL_USER);
     idt_add_desc(PRINT_INT, print_int, IDT_TRAP, IDT_DPL_USER);
@@ -105,8 +106,24 @@ int idt_init()
     idt_add_desc(VANISH_INT, vanish_int, IDT_TRAP, IDT_DPL_USER);
     idt_add_desc(READFILE_INT, readfile_int, IDT_TRAP, IDT_DPL_USER);
     idt_add_desc(SIZEFILE_INT, sizefile_int, IDT_TRAP, IDT_DPL_USER);
-    idt_add_desc(WRITEFILE_INT, deletefile_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(WRITEFILE_INT, writefile_int, IDT_TRAP, IDT_DPL_USER);
     idt_add_desc(DELETEFILE_INT, deletefile_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(CLONEFILE_INT, clonefile_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(PREALLOCFILE_INT, preallocfile_int, IDT_TRAP,
+                 IDT_DPL_USER);
+    idt_add_desc(EXTENTSFILE_INT, extentsfile_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(DISKPOLL_INT, diskpoll_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(DISKSTATS_INT, diskstats_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(OPENFILE_INT, openfile_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(READFD_INT, readfd_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(WRITEFD_INT, writefd_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(SEEKFD_INT, seekfd_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(CLOSEFD_INT, closefd_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(SYNCFD_INT, syncfd_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(AIOREAD_INT, aioread_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(AIOWRITE_INT, aiowrite_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(AIOPOLL_INT, aiopoll_int, IDT_TRAP, IDT_DPL_USER);
+    idt_add_desc(AIOWAIT_INT, aiowait_int, IDT_TRAP, IDT_DPL_USER);
     idt_add_desc(SWEXN_INT, swexn_int, IDT_TRAP, IDT_DPL_USER);
 
     idt_add_desc(IDT_DE, exn_divide_wrapper, IDT_INT, IDT_DPL_USER);
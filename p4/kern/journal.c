@@ -0,0 +1,752 @@
+/** @file journal.c
+ *  @brief Write-ahead journal for filesystem metadata.
+ *
+ *  Metadata sectors written while the filesystem lock is held are logged in
+ *  the running transaction rather than written in place.  A transaction is
+ *  committed to the journal region with a single sequential write: a header
+ *  sector listing the home address of each logged sector, followed by the
+ *  sectors themselves.  Operations which finish while a commit is in
+ *  progress join the next transaction, so concurrent writers share one
+ *  commit.  A transaction is ended under the filesystem lock, between
+ *  operations, before anything but a full transaction is committed.
+ *
+ *  File data is not journaled, so before a transaction is committed the
+ *  write-behind cache writes out the data cached while it was running,
+ *  which its metadata may point at.
+ *
+ *  Committed sectors stay in memory until the checkpoint thread has written
+ *  them to their home locations, after which their journal space is
+ *  reclaimed.  Reads of metadata check the journal first so they never see
+ *  a stale home location.  When mounting, committed transactions which were
+ *  not checkpointed are replayed.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug An operation which logs more than JOURNAL_MAX_SECTORS sectors is
+ *  split across transactions and is not atomic.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ide.h>
+#include <kern_common.h>
+#include <mutex.h>
+#include <cond.h>
+#include <writeback.h>
+#include <journal.h>
+
+#define JOURNAL_CONSTANT 0x4a524e4c
+
+#define JOURNAL_SUPER_ADDR 0
+#define JOURNAL_FIRST 1
+
+#define JOURNAL_MAX_SECTORS ((IDE_SECTOR_SIZE - 16) / sizeof(int))
+#define JOURNAL_INIT_SECTORS 8
+
+/* The first sector of the journal, locating the oldest live transaction */
+typedef struct journal_super {
+    int constant;
+    int start;
+    int seq;
+    char padding[IDE_SECTOR_SIZE - 12];
+} journal_super_t;
+
+/* The first sector of a transaction in the journal */
+typedef struct journal_header {
+    int constant;
+    int seq;
+    int count;
+    unsigned checksum;
+    int addrs[JOURNAL_MAX_SECTORS];
+} journal_header_t;
+
+/* A transaction, laid out in memory exactly as it is written to disk */
+typedef struct transaction {
+    int offset;
+    int max;
+    char *buf;
+    struct transaction *next;
+} transaction_t;
+
+#define HEADER(T) ((journal_header_t *)(T)->buf)
+#define SECTOR(T, I) ((T)->buf + ((I) + 1) * IDE_SECTOR_SIZE)
+
+/* The mounted journal */
+typedef struct journal {
+    mutex_t lock;
+    cond_t commit_cv;
+    cond_t checkpoint_cv;
+    cond_t space_cv;
+    int start;
+    int len;
+    int head;
+    int tail;
+    int next_seq;
+    int committed_seq;
+    transaction_t *running;
+    transaction_t *sealed;
+    transaction_t *sealed_tail;
+    transaction_t *committing;
+    transaction_t *committed;
+    transaction_t *committed_tail;
+    bool checkpointing;
+    bool checkpointer;
+} journal_t;
+
+static journal_t journal;
+
+static unsigned checksum(char *buf, int count) {
+    unsigned sum = 0;
+    unsigned *word = (unsigned *)buf;
+    int i;
+    for (i = 0; i < count * IDE_SECTOR_SIZE / sizeof(unsigned); i++)
+        sum = (sum << 1 | sum >> 31) ^ word[i];
+    return sum;
+}
+
+static int write_super(int start, int seq) {
+    journal_super_t *super = malloc(sizeof(journal_super_t));
+    if (super == NULL)
+        return -1;
+
+    memset(super, 0, sizeof(journal_super_t));
+    super->constant = JOURNAL_CONSTANT;
+    super->start = start;
+    super->seq = seq;
+
+    int rv = dma_write(journal.start + JOURNAL_SUPER_ADDR, super, 1);
+    free(super);
+
+    return rv;
+}
+
+static transaction_t *new_transaction() {
+    transaction_t *t = malloc(sizeof(transaction_t));
+    if (t == NULL)
+        return NULL;
+
+    t->buf = malloc((JOURNAL_INIT_SECTORS + 1) * IDE_SECTOR_SIZE);
+    if (t->buf == NULL) {
+        free(t);
+        return NULL;
+    }
+
+    memset(t->buf, 0, IDE_SECTOR_SIZE);
+    HEADER(t)->constant = JOURNAL_CONSTANT;
+    HEADER(t)->seq = journal.next_seq++;
+    HEADER(t)->count = 0;
+    t->offset = 0;
+    t->max = JOURNAL_INIT_SECTORS;
+    t->next = NULL;
+
+    return t;
+}
+
+static void free_transaction(transaction_t *t) {
+    free(t->buf);
+    free(t);
+}
+
+/** @brief Finds a sector in a transaction.
+ *
+ *  @return The index of the sector, or -1 if it is not in the transaction.
+ */
+static int find_sector(transaction_t *t, int addr) {
+    int i;
+    for (i = HEADER(t)->count - 1; i >= 0; i--) {
+        if (HEADER(t)->addrs[i] == addr)
+            return i;
+    }
+    return -1;
+}
+
+/** @brief Replays committed transactions and resets the journal.
+ *
+ *  Transactions are replayed in sequence from the one the journal
+ *  superblock points at.  A transaction which did not fit before the end
+ *  of the journal was written at the start instead.  Replay stops at the
+ *  first header which is missing, older than the transactions already
+ *  replayed, or whose sectors do not match its checksum, since that
+ *  transaction was never fully committed.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int replay() {
+    journal_super_t *super = malloc(sizeof(journal_super_t));
+    if (super == NULL)
+        return -1;
+
+    if (dma_read(journal.start + JOURNAL_SUPER_ADDR, super, 1) < 0) {
+        free(super);
+        return -2;
+    }
+
+    int offset = JOURNAL_FIRST;
+    int seq = 1;
+    if (super->constant == JOURNAL_CONSTANT) {
+        offset = super->start;
+        seq = super->seq;
+    }
+    bool fresh = super->constant != JOURNAL_CONSTANT;
+    free(super);
+
+    char *buf = malloc((JOURNAL_MAX_SECTORS + 1) * IDE_SECTOR_SIZE);
+    if (buf == NULL)
+        return -3;
+    journal_header_t *header = (journal_header_t *)buf;
+
+    int rv = 0;
+    bool wrapped = false;
+
+    while (!fresh) {
+        bool valid = offset >= JOURNAL_FIRST && offset < journal.len &&
+                     dma_read(journal.start + offset, buf, 1) == 0 &&
+                     header->constant == JOURNAL_CONSTANT &&
+                     header->seq >= seq && header->count >= 0 &&
+                     header->count <= JOURNAL_MAX_SECTORS &&
+                     offset + 1 + header->count <= journal.len;
+        if (valid && header->count > 0) {
+            valid = dma_read(journal.start + offset + 1,
+                             buf + IDE_SECTOR_SIZE, header->count) == 0 &&
+                    header->checksum == checksum(buf + IDE_SECTOR_SIZE,
+                                                 header->count);
+        }
+
+        if (!valid) {
+            if (wrapped || offset == JOURNAL_FIRST)
+                break;
+            offset = JOURNAL_FIRST;
+            wrapped = true;
+            continue;
+        }
+
+        int i;
+        for (i = 0; i < header->count; i++) {
+            if (dma_write(header->addrs[i],
+                          buf + (i + 1) * IDE_SECTOR_SIZE, 1) < 0) {
+                rv = -4;
+                break;
+            }
+        }
+        if (rv < 0)
+            break;
+
+        offset += 1 + header->count;
+        seq = header->seq + 1;
+        wrapped = false;
+    }
+
+    free(buf);
+
+    if (rv < 0)
+        return rv;
+
+    if (offset < JOURNAL_FIRST || offset >= journal.len)
+        offset = JOURNAL_FIRST;
+
+    journal.head = offset;
+    journal.tail = offset;
+    journal.next_seq = seq;
+    journal.committed_seq = seq - 1;
+
+    return write_super(offset, seq);
+}
+
+/** @brief Mounts the journal, replaying any committed transactions.
+ *
+ *  Until the journal is mounted, metadata writes go straight to disk.
+ *
+ *  @param start The first sector of the journal region.
+ *  @param len The number of sectors in the journal region.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int journal_mount(int start, int len)
+{
+    if (len < JOURNAL_MAX_SECTORS + 2)
+        return -1;
+
+    if (mutex_init(&journal.lock) < 0 ||
+        cond_init(&journal.commit_cv) < 0 ||
+        cond_init(&journal.checkpoint_cv) < 0 ||
+        cond_init(&journal.space_cv) < 0)
+        return -2;
+
+    journal.start = start;
+    journal.len = len;
+    journal.running = NULL;
+    journal.sealed = NULL;
+    journal.sealed_tail = NULL;
+    journal.committing = NULL;
+    journal.committed = NULL;
+    journal.committed_tail = NULL;
+    journal.checkpointing = false;
+    journal.checkpointer = false;
+
+    if (replay() < 0) {
+        journal.len = 0;
+        return -3;
+    }
+
+    return 0;
+}
+
+/** @brief Writes committed transactions to their home locations.
+ *
+ *  Only the newest copy of a sector is written.  Must be called with the
+ *  journal lock held; it is released while writing.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int checkpoint() {
+    transaction_t *first = journal.committed;
+    transaction_t *last = journal.committed_tail;
+    if (first == NULL || journal.checkpointing)
+        return 0;
+
+    journal.checkpointing = true;
+    mutex_unlock(&journal.lock);
+
+    int rv = 0;
+
+    transaction_t *t;
+    for (t = first; rv == 0; t = t->next) {
+        int i;
+        for (i = 0; i < HEADER(t)->count; i++) {
+            int addr = HEADER(t)->addrs[i];
+
+            // Skip sectors overwritten by a later transaction
+            transaction_t *later;
+            for (later = t->next; later != last->next; later = later->next) {
+                if (find_sector(later, addr) >= 0)
+                    break;
+            }
+            if (later != last->next)
+                continue;
+
+            if (dma_write(addr, SECTOR(t, i), 1) < 0) {
+                rv = -1;
+                break;
+            }
+        }
+        if (t == last)
+            break;
+    }
+
+    mutex_lock(&journal.lock);
+    journal.checkpointing = false;
+
+    if (rv < 0) {
+        cond_broadcast(&journal.space_cv);
+        return rv;
+    }
+
+    journal.committed = last->next;
+    if (journal.committed == NULL)
+        journal.committed_tail = NULL;
+
+    // The oldest transaction still live may be one being committed
+    int seq = HEADER(last)->seq + 1;
+    int tail = journal.head;
+    if (journal.committed != NULL)
+        tail = journal.committed->offset;
+    else if (journal.committing != NULL && journal.committing->offset != 0)
+        tail = journal.committing->offset;
+    while (first != journal.committed) {
+        t = first->next;
+        free_transaction(first);
+        first = t;
+    }
+
+    rv = write_super(tail, seq);
+    if (rv == 0)
+        journal.tail = tail;
+    cond_broadcast(&journal.space_cv);
+
+    return rv;
+}
+
+/** @brief Finds space in the journal for a transaction.
+ *
+ *  Transactions are never split across the end of the journal; one which
+ *  does not fit before the end is written at the start.
+ *
+ *  @return The offset to write at, or -1 if there is not enough space.
+ */
+static int find_space(int len) {
+    bool empty = journal.committed == NULL;
+    if (journal.head >= journal.tail) {
+        if (journal.head + len <= journal.len)
+            return journal.head;
+        if (JOURNAL_FIRST + len < journal.tail ||
+            (empty && JOURNAL_FIRST + len <= journal.len))
+            return JOURNAL_FIRST;
+    } else if (journal.head + len < journal.tail) {
+        return journal.head;
+    }
+    return -1;
+}
+
+/** @brief Writes a transaction to the journal.
+ *
+ *  Must be called with the journal lock held by the only committer.  The
+ *  lock is released while writing.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int write_transaction(transaction_t *t) {
+    int len = HEADER(t)->count + 1;
+
+    int offset;
+    while ((offset = find_space(len)) < 0) {
+        if (journal.checkpointer || journal.checkpointing) {
+            cond_signal(&journal.checkpoint_cv);
+            cond_wait(&journal.space_cv, &journal.lock);
+        } else if (checkpoint() < 0) {
+            return -1;
+        }
+    }
+
+    t->offset = offset;
+    journal.head = offset + len;
+
+    HEADER(t)->checksum = checksum(SECTOR(t, 0), HEADER(t)->count);
+
+    mutex_unlock(&journal.lock);
+    int rv = dma_write(journal.start + offset, t->buf, len);
+    mutex_lock(&journal.lock);
+
+    // Do not leave a torn transaction in the middle of the journal
+    if (rv < 0) {
+        t->offset = 0;
+        journal.head = offset;
+    }
+
+    return rv;
+}
+
+/** @brief Writes a transaction's sectors directly to their home locations.
+ *
+ *  Used when a transaction cannot be written to the journal.
+ */
+static int write_in_place(transaction_t *t) {
+    int i;
+    for (i = 0; i < HEADER(t)->count; i++) {
+        if (dma_write(HEADER(t)->addrs[i], SECTOR(t, i), 1) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/** @brief Commits transactions until the given one is on disk.
+ *
+ *  The first caller to find no commit in progress commits the oldest ended
+ *  transaction on behalf of every operation logged in it; others wait.
+ *  The running transaction is only committed if it is the one asked for,
+ *  which a caller holding the filesystem lock may do.
+ *
+ *  @param seq The sequence number of the transaction.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int journal_commit(int seq)
+{
+    if (journal.len == 0)
+        return 0;
+
+    int rv = 0;
+
+    mutex_lock(&journal.lock);
+    while (journal.committed_seq < seq) {
+        if (journal.committing != NULL) {
+            cond_wait(&journal.commit_cv, &journal.lock);
+            continue;
+        }
+
+        transaction_t *t = journal.sealed;
+        if (t != NULL && HEADER(t)->seq > seq)
+            break;
+        if (t != NULL) {
+            journal.sealed = t->next;
+            if (journal.sealed == NULL)
+                journal.sealed_tail = NULL;
+            t->next = NULL;
+        } else {
+            t = journal.running;
+            if (t == NULL || HEADER(t)->seq > seq)
+                break;
+            journal.running = NULL;
+        }
+        journal.committing = t;
+
+        // The data the transaction's metadata may point at goes first
+        mutex_unlock(&journal.lock);
+        if (writeback_flush_seq(HEADER(t)->seq) < 0)
+            rv = -2;
+        mutex_lock(&journal.lock);
+
+        if (write_transaction(t) < 0) {
+            // Replay tolerates the gap this leaves in the sequence
+            journal.committing = NULL;
+            journal.committed_seq = HEADER(t)->seq;
+            if (write_in_place(t) < 0)
+                rv = -1;
+            free_transaction(t);
+            cond_broadcast(&journal.commit_cv);
+            continue;
+        }
+
+        journal.committing = NULL;
+        journal.committed_seq = HEADER(t)->seq;
+        if (journal.committed_tail == NULL)
+            journal.committed = t;
+        else
+            journal.committed_tail->next = t;
+        journal.committed_tail = t;
+
+        cond_broadcast(&journal.commit_cv);
+        cond_signal(&journal.checkpoint_cv);
+    }
+    mutex_unlock(&journal.lock);
+
+    return rv;
+}
+
+/** @brief Gets the sequence number of the transaction sectors logged now
+ *  go into.
+ *
+ *  That is the running transaction, or the next one if none is running.
+ *  Called with the filesystem lock held, so that file data written by an
+ *  operation can be tied to the transaction holding its metadata.
+ */
+int journal_seq()
+{
+    mutex_lock(&journal.lock);
+    int seq = journal.next_seq;
+    if (journal.running != NULL)
+        seq = HEADER(journal.running)->seq;
+    mutex_unlock(&journal.lock);
+    return seq;
+}
+
+/** @brief Ends the running transaction, so that it can be committed.
+ *
+ *  Later operations log to a new transaction.  Must be called with the
+ *  filesystem lock held, between operations, so that no operation has
+ *  logged only part of its updates or not yet cached the data they point
+ *  at.
+ *
+ *  @return The sequence number of the ended transaction, or of the last
+ *  one if none was running.
+ */
+int journal_seal()
+{
+    mutex_lock(&journal.lock);
+
+    int seq = journal.next_seq - 1;
+    transaction_t *t = journal.running;
+    if (t != NULL) {
+        journal.running = NULL;
+        if (journal.sealed_tail == NULL)
+            journal.sealed = t;
+        else
+            journal.sealed_tail->next = t;
+        journal.sealed_tail = t;
+    }
+
+    mutex_unlock(&journal.lock);
+
+    return seq;
+}
+
+/** @brief Logs a metadata sector in the running transaction.
+ *
+ *  Must be called with the filesystem lock held.  If the running
+ *  transaction is full it is committed first.
+ *
+ *  @param addr The home address of the sector.
+ *  @param buf The contents of the sector.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int journal_write(int addr, void *buf)
+{
+    if (journal.len == 0)
+        return dma_write(addr, buf, 1);
+
+    mutex_lock(&journal.lock);
+
+    transaction_t *t = journal.running;
+    if (t != NULL && find_sector(t, addr) < 0 &&
+        HEADER(t)->count == JOURNAL_MAX_SECTORS) {
+        int seq = HEADER(t)->seq;
+        mutex_unlock(&journal.lock);
+        if (journal_commit(seq) < 0)
+            return -1;
+        mutex_lock(&journal.lock);
+        t = journal.running;
+    }
+
+    if (t == NULL) {
+        if ((t = new_transaction()) == NULL) {
+            mutex_unlock(&journal.lock);
+            return -2;
+        }
+        journal.running = t;
+    }
+
+    int i = find_sector(t, addr);
+    if (i < 0) {
+        if (HEADER(t)->count == t->max) {
+            int max = MIN(2 * t->max, JOURNAL_MAX_SECTORS);
+            char *buf = realloc(t->buf, (max + 1) * IDE_SECTOR_SIZE);
+            if (buf == NULL) {
+                mutex_unlock(&journal.lock);
+                return -3;
+            }
+            t->buf = buf;
+            t->max = max;
+        }
+        i = HEADER(t)->count++;
+        HEADER(t)->addrs[i] = addr;
+    }
+    memcpy(SECTOR(t, i), buf, IDE_SECTOR_SIZE);
+
+    mutex_unlock(&journal.lock);
+
+    return 0;
+}
+
+/** @brief Checks whether a transaction logs any sector in a range. */
+static bool logs_range(transaction_t *t, int start, int len) {
+    int i;
+    for (i = 0; i < HEADER(t)->count; i++) {
+        int addr = HEADER(t)->addrs[i];
+        if (addr >= start && addr < start + len)
+            return true;
+    }
+    return false;
+}
+
+/** @brief Drops the sectors in a range from an uncommitted transaction. */
+static void drop_range(transaction_t *t, int start, int len) {
+    int i = 0;
+    while (i < HEADER(t)->count) {
+        int addr = HEADER(t)->addrs[i];
+        if (addr < start || addr >= start + len) {
+            i++;
+            continue;
+        }
+        int last = --HEADER(t)->count;
+        HEADER(t)->addrs[i] = HEADER(t)->addrs[last];
+        memcpy(SECTOR(t, i), SECTOR(t, last), IDE_SECTOR_SIZE);
+    }
+}
+
+/** @brief Stops the journal writing sectors which are reused for file data.
+ *
+ *  File data is written in place rather than journaled, so a freed metadata
+ *  sector which is reallocated for data must not later be overwritten by a
+ *  checkpoint or a replay of its old contents.  The sectors are dropped from
+ *  the transactions not yet being committed, and any committed transaction
+ *  still logging them is checkpointed first.  Must be called with the
+ *  filesystem lock held.
+ *
+ *  @param start The first sector.
+ *  @param len The number of sectors.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int journal_revoke(int start, int len)
+{
+    if (journal.len == 0)
+        return 0;
+
+    mutex_lock(&journal.lock);
+
+    transaction_t *t;
+    for (t = journal.sealed; t != NULL; t = t->next)
+        drop_range(t, start, len);
+    if (journal.running != NULL)
+        drop_range(journal.running, start, len);
+
+    int rv = 0;
+
+    while (rv == 0) {
+        bool logged = journal.committing != NULL &&
+                      logs_range(journal.committing, start, len);
+        for (t = journal.committed; t != NULL && !logged; t = t->next)
+            logged = logs_range(t, start, len);
+        if (!logged)
+            break;
+
+        if (journal.committing != NULL) {
+            cond_wait(&journal.commit_cv, &journal.lock);
+        } else if (journal.checkpointer || journal.checkpointing) {
+            cond_signal(&journal.checkpoint_cv);
+            cond_wait(&journal.space_cv, &journal.lock);
+        } else {
+            rv = checkpoint();
+        }
+    }
+
+    mutex_unlock(&journal.lock);
+
+    return rv;
+}
+
+/** @brief Reads a metadata sector, preferring its newest journaled copy.
+ *
+ *  @param addr The home address of the sector.
+ *  @param buf The buffer to read into.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int journal_read(int addr, void *buf)
+{
+    if (journal.len == 0)
+        return dma_read(addr, buf, 1);
+
+    mutex_lock(&journal.lock);
+
+    transaction_t *found = NULL;
+    int index = -1;
+
+    // Oldest first, so the newest copy is found last
+    transaction_t *lists[] = { journal.committed, journal.committing,
+                               journal.sealed, journal.running };
+    int j;
+    for (j = 0; j < 4; j++) {
+        transaction_t *t;
+        for (t = lists[j]; t != NULL; t = t->next) {
+            int i = find_sector(t, addr);
+            if (i >= 0) {
+                found = t;
+                index = i;
+            }
+        }
+    }
+
+    if (found != NULL) {
+        memcpy(buf, SECTOR(found, index), IDE_SECTOR_SIZE);
+        mutex_unlock(&journal.lock);
+        return 0;
+    }
+
+    mutex_unlock(&journal.lock);
+
+    return dma_read(addr, buf, 1);
+}
+
+/** @brief Checkpoints committed transactions in the background.
+ *
+ *  Run as a kernel thread.  Commits which arrive while a checkpoint is in
+ *  progress are checkpointed together on the next pass.
+ *
+ *  @return Does not return.
+ */
+void journal_checkpointer()
+{
+    mutex_lock(&journal.lock);
+    journal.checkpointer = true;
+    while (1) {
+        while (journal.committed == NULL || journal.checkpointing)
+            cond_wait(&journal.checkpoint_cv, &journal.lock);
+        checkpoint();
+    }
+}
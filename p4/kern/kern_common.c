@@ -97,6 +97,9 @@ int buf_lock(int len, char *buf)
         return -1;
     }
 
+    //fill any file mapping pages the buffer lies in
+    vm_map_fill_len(buf, len);
+
     if (!vm_lock_len(buf, len, USER_FLAGS_RO, 0, MEMLOCK_ACCESS)) {
         return -2;
     }
@@ -36,6 +36,9 @@
 #include <exception.h>
 #include <malloc_wrappers.h>
 #include <kern_common.h>
+#include <disk.h>
+#include <journal.h>
+#include <writeback.h>
 
 bool kernel_init = true;
 
@@ -53,6 +56,41 @@ typedef struct {
     unsigned ss;
 } iret_args_t;
 
+/** @brief Creates a thread which runs a kernel function in its own process.
+ *
+ *  The thread must be added to the scheduler queue before it runs.  Leaves
+ *  the new process's page directory loaded.
+ *
+ *  @param entry The function to run.  It must not return.
+ *  @param name The name of the thread, for panic messages.
+ *  @return The TCB of the new thread.
+ */
+static tcb_t *new_kernel_thread(void (*entry)(), const char *name)
+{
+    tcb_t *tcb;
+    pcb_t *pcb;
+    if (proc_new_process(&pcb, &tcb) < 0) {
+        panic("Failed to create %s", name);
+    }
+
+    //Create a new page directory
+    if (vm_new_pd(&pcb->pd) < 0) {
+        panic("Failed to create page directory");
+    }
+
+    set_cr3((unsigned)pcb->pd);
+
+    //Artificially define saved regs
+    tcb->regs.eip = (unsigned)entry;
+    tcb->regs.esp_offset = 0;
+    tcb->regs.cr2 = 0;
+    tcb->regs.cr3 = (unsigned)pcb->pd;
+    tcb->regs.ebp_offset = -tcb->esp0;
+    tcb->regs.eflags = USER_EFLAGS & (~EFL_IF);
+
+    return tcb;
+}
+
 /** @brief Kernel entrypoint.
  *
  *  This is the entrypoint for the kernel.
@@ -95,6 +133,11 @@ int kernel_main(mbinfo_t *mbinfo, int argc, char **argv, char **envp)
     }
     cur_tcb = idle_tcb;
 
+    /* Mount the filesystem before loading anything from it */
+    if (fs_mount() < 0) {
+        panic("Failed to mount filesystem");
+    }
+
     //Create a new page directory
     if (vm_new_pd(&idle_pcb->pd) < 0) {
         panic("Failed to create page directory");
@@ -128,26 +171,20 @@ int kernel_main(mbinfo_t *mbinfo, int argc, char **argv, char **envp)
     idle_wrap_esp->ss = SEGSEL_USER_DS;
 
     /* Setup Thread Reaper */
-    tcb_t *tr_tcb;
-    pcb_t *tr_pcb;
-    if (proc_new_process(&tr_pcb, &tr_tcb) < 0) {
-        panic("Failed to create thread reaper");
-    }
+    tcb_t *tr_tcb = new_kernel_thread(thread_reaper, "thread reaper");
 
-    //Create a new page directory
-    if (vm_new_pd(&tr_pcb->pd) < 0) {
-        panic("Failed to create page directory");
-    }
+    /* Setup journal checkpointer */
+    tcb_t *jc_tcb = new_kernel_thread(journal_checkpointer,
+                                      "journal checkpointer");
 
-    set_cr3((unsigned)tr_pcb->pd);
+    /* Setup writeback flusher */
+    tcb_t *wb_tcb = new_kernel_thread(writeback_flusher, "writeback flusher");
 
-    //Artificially define saved regs
-    tr_tcb->regs.eip = (unsigned)thread_reaper;
-    tr_tcb->regs.esp_offset = 0;
-    tr_tcb->regs.cr2 = 0;
-    tr_tcb->regs.cr3 = (unsigned)tr_pcb->pd;
-    tr_tcb->regs.ebp_offset = -tr_tcb->esp0;
-    tr_tcb->regs.eflags = USER_EFLAGS & (~EFL_IF);
+    /* Setup readahead */
+    tcb_t *ra_tcb = new_kernel_thread(fs_readahead, "readahead");
+
+    /* Setup defragmenter */
+    tcb_t *df_tcb = new_kernel_thread(fs_defrag, "defragmenter");
 
     /* Setup init */
     tcb_t *init_tcb;
@@ -171,6 +208,14 @@ int kernel_main(mbinfo_t *mbinfo, int argc, char **argv, char **envp)
 
     linklist_add_head(&scheduler_queue, (void*)tr_tcb,
         &tr_tcb->scheduler_listnode);
+    linklist_add_head(&scheduler_queue, (void*)jc_tcb,
+        &jc_tcb->scheduler_listnode);
+    linklist_add_head(&scheduler_queue, (void*)wb_tcb,
+        &wb_tcb->scheduler_listnode);
+    linklist_add_head(&scheduler_queue, (void*)ra_tcb,
+        &ra_tcb->scheduler_listnode);
+    linklist_add_head(&scheduler_queue, (void*)df_tcb,
+        &df_tcb->scheduler_listnode);
     linklist_add_head(&scheduler_queue, (void*)init_tcb,
         &init_tcb->scheduler_listnode);
 
@@ -31,6 +31,7 @@
 #include <assert.h>
 #include <exception.h>
 #include <proc.h>
+#include <disk.h>
 
 //MUST BE PAGE ALIGNED
 #define USER_STACK_TOP ((char*)0xC0000000u)
@@ -45,6 +46,9 @@
 /**
  * Copies data from a file into a buffer.
  *
+ * While a program is being loaded, its file is read through the handle
+ * opened by load, so the name is not looked up again on every call.
+ *
  * @param filename   the name of the file to copy data from
  * @param offset     the location in the file to begin copying from
  * @param size       the number of bytes to be copied
@@ -54,9 +58,33 @@
  */
 int getbytes(const char *filename, int offset, int size, char *buf)
 {
+    fs_file_t *file = gettcb()->exec_file;
+    if (file != NULL)
+        return fs_pread(file, buf, size, offset);
+
     return readfile((char *)filename, buf, size, offset);
 }
 
+/** @brief Closes the file of the program being loaded. */
+static void close_exec_file()
+{
+    tcb_t *tcb = gettcb();
+    if (tcb->exec_file != NULL) {
+        fs_close(tcb->exec_file);
+        tcb->exec_file = NULL;
+    }
+}
+
+/** @brief Kills the thread after running out of memory part way through
+ *  loading a program.
+ */
+static void load_kill_thread() NORETURN;
+static void load_kill_thread()
+{
+    close_exec_file();
+    proc_kill_thread("Killing thread. Out of memory.");
+}
+
 /**
  * @brief Performs simple checks to determine if a ELF file is valid.
  *
@@ -132,7 +160,7 @@ static unsigned fill_mem(const simple_elf_t *se_hdr, int argc, char *argv[],
 
     /* Copy arguments to argument space */
     if (new_pages(USER_ARGV_START, PAGE_SIZE) < 0) {
-        proc_kill_thread("Killing thread. Out of memory.");
+        load_kill_thread();
     }
 
     char **new_argv = (char**)(USER_ARGV_START);
@@ -149,7 +177,7 @@ static unsigned fill_mem(const simple_elf_t *se_hdr, int argc, char *argv[],
         alloc_pages(se_hdr->e_datstart, se_hdr->e_datlen, false) < 0 ||
         alloc_pages(se_hdr->e_rodatstart, se_hdr->e_rodatlen, true) < 0 ||
         alloc_pages(se_hdr->e_bssstart, se_hdr->e_bsslen, false) < 0) {
-        proc_kill_thread("Killing thread. Out of memory.");
+        load_kill_thread();
     }
 
     assert (getbytes(se_hdr->e_fname, se_hdr->e_txtoff, se_hdr->e_txtlen,
@@ -163,7 +191,7 @@ static unsigned fill_mem(const simple_elf_t *se_hdr, int argc, char *argv[],
     char *stack_low = USER_STACK_TOP - USER_STACK_SIZE;
 
     if (new_pages(stack_low, USER_STACK_SIZE) < 0) {
-        proc_kill_thread("Killing thread. Out of memory.");
+        load_kill_thread();
     }
 
     unsigned esp = (unsigned)USER_STACK_TOP;
@@ -195,25 +223,17 @@ int str_arr_len(char *arr[])
     return len;
 }
 
-/** @brief Loads a user program.
- *
- *  Replaces the program currently running in the invoking task with
- *  the program stored in the file named execname.  The argument points to a
- *  null-terminated vector of null-terminated string arguments.
+/** @brief Loads a user program whose file is open for the current thread.
  *
  *  @param filename The program file name.
  *  @param argv The argument vector.
- *  @param kernel_mode A boolean indicating whether it is legal for arguments
- *  to point to kernel memory.
- *  @return Does not return on success, a negative error code on
- *  failure.
+ *  @param eip Memory to store the program's entry point.
+ *  @param esp Memory to store the program's initial stack pointer.
+ *  @return 0 on success, negative error code otherwise.
  */
-int load(char *filename, char *argv[], unsigned *eip, unsigned *esp)
+static int load_file(char *filename, char *argv[], unsigned *eip,
+                     unsigned *esp)
 {
-    if (getpcb()->num_threads > 1) {
-        return -1;
-    }
-
     if (elf_check_header(filename) != ELF_SUCCESS) {
         return -2;
     }
@@ -279,6 +299,36 @@ int load(char *filename, char *argv[], unsigned *eip, unsigned *esp)
     return 0;
 }
 
+/** @brief Loads a user program.
+ *
+ *  Replaces the program currently running in the invoking task with
+ *  the program stored in the file named execname.  The argument points to a
+ *  null-terminated vector of null-terminated string arguments.  The file is
+ *  looked up once and read through an open handle for the whole load.
+ *
+ *  @param filename The program file name.
+ *  @param argv The argument vector.
+ *  @param kernel_mode A boolean indicating whether it is legal for arguments
+ *  to point to kernel memory.
+ *  @return Does not return on success, a negative error code on
+ *  failure.
+ */
+int load(char *filename, char *argv[], unsigned *eip, unsigned *esp)
+{
+    if (getpcb()->num_threads > 1) {
+        return -1;
+    }
+
+    if ((gettcb()->exec_file = fs_open(filename)) == NULL) {
+        return -2;
+    }
+
+    int rv = load_file(filename, argv, eip, esp);
+    close_exec_file();
+
+    return rv;
+}
+
 /** @brief Loads a user program.
  *
  *  A wrapper for load with kernel_mode set to false.
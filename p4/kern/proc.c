@@ -96,6 +96,10 @@ int proc_init() {
         return -7;
      }
 
+     if (fd_init() < 0) {
+        return -8;
+     }
+
      return 0;
 }
 
@@ -133,10 +137,22 @@ int proc_new_process(pcb_t **pcb_out, tcb_t **tcb_out) {
         return -5;
     }
 
+    if (linklist_init(&pcb->mappings) < 0) {
+        return -5;
+    }
+
     if (init_locks(&pcb->locks) < 0) {
         return -6;
     }
 
+    if (fd_table_init(&pcb->fds) < 0) {
+        return -6;
+    }
+
+    if (aio_table_init(&pcb->aio) < 0) {
+        return -6;
+    }
+
     pcb->pid = -1;
     pcb->status = 0;
     pcb->num_threads = 0;
@@ -183,6 +199,7 @@ int proc_new_thread(pcb_t *pcb, tcb_t **tcb_out) {
     tcb->pcb = pcb;
     tcb->esp0 = (unsigned)esp0;
     tcb->sleep_flag = 0;
+    tcb->exec_file = NULL;
     deregister_swexn_handler(tcb);
 
     pcb->num_threads++;
@@ -365,7 +382,9 @@ void vanish()
     pcb_t *pcb = getpcb();
     deregister_swexn_handler(gettcb());
     if (pcb->num_threads == 1) {
+        aio_table_clear(&pcb->aio);
         vm_clear();
+        fd_table_clear(&pcb->fds);
     }
 
     //Tell children their father died :(
@@ -282,6 +282,18 @@ int make_runnable_kern(tcb_t *tcb, bool user)
     return 0;
 }
 
+/** @brief Checks whether a thread other than the caller could run.
+ *
+ *  Must be called with interrupts disabled.
+ *
+ *  @return Whether another thread is runnable.
+ */
+bool scheduler_others_runnable()
+{
+    listnode_t *head = scheduler_queue.head;
+    return head != NULL && (head->data != gettcb() || head->next != NULL);
+}
+
 /** @brief Deschedules the calling thread until at least ticks timer interrupts
  *  have occured after the call.
  *
@@ -2,13 +2,16 @@
  *  @brief Manages virtual memory.
  *
  *  Manages virtual memory using a two-level page table structure.  Implements
- *  new_pages and remove_pages system calls.  Free physical frames are kept in
- *  a linked list.  The length of memory regions allocated by calls to
- *  new_pages are kept in a hashtable.
+ *  new_pages, mapfile and remove_pages system calls.  Free physical frames are
+ *  kept in a linked list.  The length of memory regions allocated by calls to
+ *  new_pages are kept in a hashtable.  Regions mapped by mapfile are kept in a
+ *  list beside it and have no pages until they are first accessed.
  *
  *  @author Patrick Koenig (phkoenig)
  *  @author Jack Sorrell (jsorrell)
- *  @bug No known bugs.
+ *  @bug Each page of a file mapping gets a frame of its own, even if the
+ *  same page of the file is already mapped elsewhere; frames are not shared
+ *  between mappings.
  */
 
 #include <vm.h>
@@ -26,6 +29,8 @@
 #include <assert.h>
 #include <free_page_linklist.h>
 #include <asm_common.h>
+#include <disk.h>
+#include <fd.h>
 
 #define PHYS_VA 0xC0001000
 
@@ -122,6 +127,51 @@ static bool is_pt_empty(pde_t *pde)
     return true;
 }
 
+/** @brief Removes every file mapping in a list, closing the files.
+ *
+ *  The pages of the mappings must already have been removed.
+ *
+ *  @param mappings The list of mappings.
+ *  @return Void.
+ */
+static void clear_mappings(linklist_t *mappings)
+{
+    vm_mapping_t *mapping;
+    while (linklist_remove_head(mappings, (void **)&mapping, NULL) == 0) {
+        fs_close(mapping->file);
+        free(mapping);
+    }
+}
+
+/** @brief Checks whether a mapping starts at a base address. */
+static bool mapping_base_eq(void *mapping, void *base)
+{
+    return ((vm_mapping_t *)mapping)->base == base;
+}
+
+/** @brief Finds the mapping of the invoking process covering an address
+ *  range.
+ *
+ *  Must be called with the alloc pages lock held.
+ *
+ *  @param base The base of the range.
+ *  @param len The length of the range.
+ *  @return The first mapping overlapping the range, or NULL if none does.
+ */
+static vm_mapping_t *find_mapping(void *base, int len)
+{
+    listnode_t *node;
+    for (node = getpcb()->mappings.head; node != NULL; node = node->next) {
+        vm_mapping_t *mapping = node->data;
+        if ((unsigned)base < (unsigned)mapping->base + mapping->len &&
+            (unsigned)mapping->base < (unsigned)base + len) {
+            return mapping;
+        }
+    }
+
+    return NULL;
+}
+
 /** @brief Initializes the virtual memory.
  *
  *  Creates a new page table directory and sets %cr3, sets the paging bit in
@@ -318,10 +368,13 @@ void vm_remove_pte(pd_t pd, void *va) {
  *  @param new_pd A pointer to memory to store the new pd.
  *  @param new_alloc_pages A pointer to the hashtable that stores the new
  *  alloc pages lengths.
+ *  @param new_mappings A pointer to the list that stores the new file
+ *  mappings.
  *
  *  @return 0 on success, negative error code otherwise.
  */
-int vm_copy(pd_t *new_pd, hashtable_t *new_alloc_pages)
+int vm_copy(pd_t *new_pd, hashtable_t *new_alloc_pages,
+    linklist_t *new_mappings)
 {
     assert(getpcb()->num_threads == 1);
     pd_t old_pd = GET_PD();
@@ -368,6 +421,21 @@ int vm_copy(pd_t *new_pd, hashtable_t *new_alloc_pages)
         return -5;
     }
 
+    //pages of mappings not yet filled are filled from the file in the child
+    listnode_t *node;
+    for (node = getpcb()->mappings.head; node != NULL; node = node->next) {
+        vm_mapping_t *mapping = node->data;
+        vm_mapping_t *new_mapping = malloc(sizeof(vm_mapping_t));
+        if (new_mapping == NULL) {
+            clear_mappings(new_mappings);
+            vm_destroy(new_pd);
+            return -6;
+        }
+        *new_mapping = *mapping;
+        fs_dup(new_mapping->file);
+        linklist_add_tail(new_mappings, new_mapping, &new_mapping->listnode);
+    }
+
     return 0;
 }
 
@@ -399,6 +467,8 @@ void vm_clear() {
 
         va += PAGE_SIZE;
     }
+
+    clear_mappings(&getpcb()->mappings);
 }
 
 /** @brief Removes a page directory.
@@ -463,6 +533,25 @@ void vm_user(void *va) {
     *pte |= PTE_SU;
 }
 
+/** @brief Translates a virtual address to a physical address.
+ *
+ *  @param va The virtual address.
+ *  @param pa Memory address to write the physical address.
+ *  @return 0 on success, negative error code if the page is not present.
+ */
+int vm_lookup_pa(void *va, unsigned *pa) {
+    pde_t pde = GET_PDE(GET_PD(), va);
+    if (!GET_PRESENT(pde))
+        return -1;
+
+    pte_t pte = GET_PTE(pde, va);
+    if (!GET_PRESENT(pte))
+        return -2;
+
+    *pa = GET_PA(pte) | ((unsigned)va & ~PAGE_MASK);
+    return 0;
+}
+
 /** @brief Checks if flags are set for a virtual memory address.
  *
  * @param va The virtual address of which to check the flags.
@@ -676,7 +765,8 @@ int new_pages(void *base, int len)
 
     //Try to add to hashtable of stored lengths
     mutex_lock(&getpcb()->locks.alloc_pages_lock);
-    if (hashtable_add(&getpcb()->alloc_pages, (int)base, (void *)len) < 0) {
+    if (find_mapping(base, len) != NULL ||
+        hashtable_add(&getpcb()->alloc_pages, (int)base, (void *)len) < 0) {
         mutex_unlock(&getpcb()->locks.alloc_pages_lock);
         vm_unlock_len(base, len);
         return -6;
@@ -715,6 +805,191 @@ int new_pages(void *base, int len)
     return 0;
 }
 
+/** @brief Maps part of an open file into memory starting at base and
+ *  extending for len bytes.
+ *
+ *  The region is read-only.  Its pages are only allocated and read from the
+ *  file when they are first accessed; bytes past the end of the file read as
+ *  zero.  The region is unmapped with remove_pages.
+ *
+ *  @param base The base of the memory region to map.
+ *  @param len The number of bytes to map.
+ *  @param fd The descriptor of the open file.
+ *  @param offset The offset in the file of the first byte mapped.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int mapfile(void *base, int len, int fd, int offset)
+{
+    if ((unsigned)base > (unsigned)base + len - 1) {
+        return -1;
+    }
+
+    if (((unsigned)base % PAGE_SIZE) != 0) {
+        return -2;
+    }
+
+    if (len <= 0 || (len % PAGE_SIZE) != 0) {
+        return -3;
+    }
+
+    if ((unsigned)base < USER_MEM_START) {
+        return -4;
+    }
+
+    if (offset < 0) {
+        return -5;
+    }
+
+    vm_mapping_t *mapping = malloc(sizeof(vm_mapping_t));
+    if (mapping == NULL) {
+        return -6;
+    }
+
+    mapping->base = base;
+    mapping->len = len;
+    mapping->offset = offset;
+    if ((mapping->file = fd_file(fd, 0)) == NULL) {
+        free(mapping);
+        return -7;
+    }
+
+    //the region must not overlap allocated pages or another mapping
+    if (!vm_lock_len(base, len, 0, PTE_PRESENT, MEMLOCK_MODIFY)) {
+        fs_close(mapping->file);
+        free(mapping);
+        return -8;
+    }
+
+    mutex_lock(&getpcb()->locks.alloc_pages_lock);
+    if (find_mapping(base, len) != NULL ||
+        hashtable_get(&getpcb()->alloc_pages, (int)base, NULL) == 0) {
+        mutex_unlock(&getpcb()->locks.alloc_pages_lock);
+        vm_unlock_len(base, len);
+        fs_close(mapping->file);
+        free(mapping);
+        return -8;
+    }
+    linklist_add_tail(&getpcb()->mappings, mapping, &mapping->listnode);
+    mutex_unlock(&getpcb()->locks.alloc_pages_lock);
+
+    vm_unlock_len(base, len);
+
+    return 0;
+}
+
+/** @brief Fills a page of a file mapping from the file.
+ *
+ *  Called on a fault on a page which is not present.  If another thread has
+ *  filled the page in the meantime there is nothing to do.  The page is
+ *  read into a new frame through fs_pread, so data held by the file's
+ *  readahead buffer or the write-behind cache is copied without reading
+ *  the disk.
+ *
+ *  @param va The faulting virtual address.
+ *  @return 0 if the page is now present, negative error code if it is not
+ *  part of a mapping or could not be filled.
+ */
+int vm_map_fill(void *va)
+{
+    va = (void *)ROUND_DOWN_PAGE(va);
+    if ((unsigned)va < USER_MEM_START) {
+        return -1;
+    }
+
+    if (!vm_lock(va, 0, PTE_PRESENT, MEMLOCK_MODIFY)) {
+        return 0;
+    }
+
+    //take a reference so the file survives the mapping being removed
+    mutex_lock(&getpcb()->locks.alloc_pages_lock);
+    vm_mapping_t *mapping = find_mapping(va, PAGE_SIZE);
+    fs_file_t *file = NULL;
+    int offset = 0;
+    if (mapping != NULL) {
+        file = fs_dup(mapping->file);
+        offset = mapping->offset + (va - mapping->base);
+    }
+    mutex_unlock(&getpcb()->locks.alloc_pages_lock);
+
+    if (file == NULL) {
+        vm_unlock(va);
+        return -2;
+    }
+
+    //disable user access until the page is filled
+    unsigned frame;
+    if (get_frame(&frame) < 0 ||
+        vm_new_pte(GET_PD(), va, frame, USER_FLAGS_RW & ~PTE_SU) < 0) {
+        fs_close(file);
+        vm_unlock(va);
+        return -3;
+    }
+
+    memset(va, 0, PAGE_SIZE);
+    int rv = fs_pread(file, va, PAGE_SIZE, offset);
+    fs_close(file);
+
+    if (rv < 0) {
+        vm_remove_pte(GET_PD(), va);
+        vm_unlock(va);
+        return -4;
+    }
+
+    vm_read_only(va);
+    vm_user(va);
+    flush_tlb_entry(va);
+
+    vm_unlock(va);
+
+    return 0;
+}
+
+/** @brief Fills any pages of file mappings in a region which are not present.
+ *
+ *  Lets the kernel access mapped memory passed to a system call.  Pages
+ *  which cannot be filled are left for the caller's checks to reject.
+ *
+ *  @param base The base of the region.
+ *  @param len The length of the region.
+ *  @return Void.
+ */
+void vm_map_fill_len(void *base, int len)
+{
+    if ((unsigned)base > (unsigned)base + len - 1) {
+        return;
+    }
+
+    unsigned va;
+    for (va = ROUND_DOWN_PAGE((unsigned)base); va < (unsigned)base + len - 1;
+         va += PAGE_SIZE) {
+        if (!vm_check_flags(GET_PD(), (void *)va, PTE_PRESENT, 0)) {
+            vm_map_fill((void *)va);
+        }
+    }
+}
+
+/** @brief Removes a file mapping and the pages filled for it.
+ *
+ *  @param mapping The mapping, no longer in the list of mappings.
+ *  @return Void.
+ */
+static void remove_mapping(vm_mapping_t *mapping)
+{
+    //wait for any fills in progress
+    assert(vm_lock_len(mapping->base, mapping->len, 0, 0, MEMLOCK_MODIFY));
+
+    unsigned va;
+    for (va = (unsigned)mapping->base;
+         va < (unsigned)mapping->base + mapping->len - 1; va += PAGE_SIZE) {
+        vm_remove_pte(GET_PD(), (void *)va);
+    }
+
+    vm_unlock_len(mapping->base, mapping->len);
+
+    fs_close(mapping->file);
+    free(mapping);
+}
+
 /** @brief Deallocate the memory region starting at base.
  *
  *  @param base The base of the memory region to deallocate.
@@ -730,8 +1005,15 @@ int remove_pages(void *base)
     mutex_lock(&getpcb()->locks.alloc_pages_lock);
     int len;
     if (hashtable_remove(&getpcb()->alloc_pages, (int)base, (void**)&len) < 0) {
+        vm_mapping_t *mapping;
+        int rv = linklist_remove(&getpcb()->mappings, base, mapping_base_eq,
+                                 (void **)&mapping, NULL);
         mutex_unlock(&getpcb()->locks.alloc_pages_lock);
-        return -2;
+        if (rv < 0) {
+            return -2;
+        }
+        remove_mapping(mapping);
+        return 0;
     }
     mutex_unlock(&getpcb()->locks.alloc_pages_lock);
 
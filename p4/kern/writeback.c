@@ -0,0 +1,508 @@
+/** @file writeback.c
+ *  @brief Write-behind cache for file data.
+ *
+ *  File data written through the cache is copied into dirty blocks and
+ *  written to disk later: by the flusher thread once it has aged, or by a
+ *  writer which finds too much data dirty.  A write to the sectors after a
+ *  dirty block extends that block, up to the size of one transfer, so a run
+ *  of small sequential writes goes to disk as a single multi-sector write.
+ *
+ *  Dirty blocks are kept sorted by sector and never overlap.  Blocks being
+ *  flushed are moved to a list of their own, so a write to their sectors
+ *  meanwhile starts a new block which is written after them.  Reads of file
+ *  data from disk must be overlaid with the cached sectors.
+ *
+ *  Metadata is not cached here but logged in the journal.  Each block is
+ *  tagged with the oldest journal transaction whose metadata may point at
+ *  its data, as read by the writer before dropping the filesystem lock, and
+ *  is flushed before that transaction is committed.  The flusher commits the transactions
+ *  whose data has all been flushed after each pass, so that operations no
+ *  longer wait for their commit and young data is not forced out early.
+ *
+ *  @author Patrick Koenig (phkoenig)
+ *  @author Jack Sorrell (jsorrell)
+ *  @bug After a crash, data written since it was last flushed is lost.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ide.h>
+#include <syscall.h>
+#include <kern_common.h>
+#include <mutex.h>
+#include <ide-dma.h>
+#include <disk.h>
+#include <writeback.h>
+
+/* The largest block, so that each block is flushed in one transfer */
+#define WRITEBACK_BLOCK_MAX DMA_MAX_SECTORS
+/* Dirty sectors beyond which writers flush the cache themselves */
+#define WRITEBACK_MAX_DIRTY 1024
+/* Ticks a block stays dirty before the flusher writes it */
+#define WRITEBACK_AGE 300
+/* Ticks between passes of the flusher */
+#define WRITEBACK_INTERVAL 100
+
+/* A run of dirty sectors */
+typedef struct wb_block {
+    int sector;
+    int len;
+    char *buf;
+    unsigned ticks;
+    int seq;
+    dma_req_t dma;
+    struct wb_block *next;
+} wb_block_t;
+
+/* The write-behind cache */
+typedef struct writeback {
+    mutex_t lock;
+    mutex_t flush_lock;
+    wb_block_t *dirty;
+    wb_block_t *writing;
+    int dirty_len;
+    unsigned flushes;
+} writeback_t;
+
+static writeback_t wb;
+
+/** @brief Initializes the write-behind cache.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+int writeback_init()
+{
+    if (mutex_init(&wb.lock) < 0 || mutex_init(&wb.flush_lock) < 0)
+        return -1;
+
+    wb.dirty = NULL;
+    wb.writing = NULL;
+    wb.dirty_len = 0;
+    wb.flushes = 0;
+
+    return 0;
+}
+
+static wb_block_t *new_block(int sector, char *buf, int len, int seq) {
+    wb_block_t *block = malloc(sizeof(wb_block_t));
+    if (block == NULL)
+        return NULL;
+
+    if ((block->buf = malloc(len * IDE_SECTOR_SIZE)) == NULL) {
+        free(block);
+        return NULL;
+    }
+    memcpy(block->buf, buf, len * IDE_SECTOR_SIZE);
+
+    block->sector = sector;
+    block->len = len;
+    block->ticks = get_ticks();
+    block->seq = seq;
+    block->next = NULL;
+
+    return block;
+}
+
+static void free_block(wb_block_t *block) {
+    free(block->buf);
+    free(block);
+}
+
+/** @brief Adds sectors to the dirty blocks.
+ *
+ *  Sectors already dirty are overwritten only if the new data is newer; a
+ *  failed flush puts its data back without overwriting later writes.  Must
+ *  be called with the cache lock held.
+ *
+ *  @param sector The first sector.
+ *  @param buf The data.
+ *  @param count The number of sectors.
+ *  @param newer Whether the data is newer than the cached data.
+ *  @param seq The journal transaction the data is tied to.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int insert(int sector, char *buf, int count, bool newer, int seq) {
+    int end = sector + count;
+    int pos = sector;
+
+    wb_block_t *prev = NULL;
+    wb_block_t *block = wb.dirty;
+    while (pos < end) {
+        while (block != NULL && block->sector + block->len <= pos) {
+            prev = block;
+            block = block->next;
+        }
+        char *src = buf + (pos - sector) * IDE_SECTOR_SIZE;
+
+        // Overwrite the sectors of a block already holding pos
+        if (block != NULL && block->sector <= pos) {
+            int len = MIN(end, block->sector + block->len) - pos;
+            if (newer) {
+                memcpy(block->buf + (pos - block->sector) * IDE_SECTOR_SIZE,
+                       src, len * IDE_SECTOR_SIZE);
+            }
+            block->seq = MIN(block->seq, seq);
+            pos += len;
+            continue;
+        }
+
+        int len = (block == NULL ? end : MIN(end, block->sector)) - pos;
+
+        // Extend the block ending at pos
+        if (prev != NULL && prev->sector + prev->len == pos &&
+            prev->len < WRITEBACK_BLOCK_MAX) {
+            int grow = MIN(len, WRITEBACK_BLOCK_MAX - prev->len);
+            char *grown = realloc(prev->buf,
+                                  (prev->len + grow) * IDE_SECTOR_SIZE);
+            if (grown == NULL)
+                return -1;
+            prev->buf = grown;
+            memcpy(prev->buf + prev->len * IDE_SECTOR_SIZE, src,
+                   grow * IDE_SECTOR_SIZE);
+            prev->len += grow;
+            prev->seq = MIN(prev->seq, seq);
+            wb.dirty_len += grow;
+            pos += grow;
+            continue;
+        }
+
+        len = MIN(len, WRITEBACK_BLOCK_MAX);
+        wb_block_t *added = new_block(pos, src, len, seq);
+        if (added == NULL)
+            return -2;
+        added->next = block;
+        if (prev == NULL)
+            wb.dirty = added;
+        else
+            prev->next = added;
+        prev = added;
+        wb.dirty_len += len;
+        pos += len;
+    }
+
+    return 0;
+}
+
+/** @brief Writes dirty blocks to disk.
+ *
+ *  Only one flush runs at a time, so blocks reach the disk in the order
+ *  they were written.  The blocks are written concurrently.  A block which
+ *  cannot be written is put back.
+ *
+ *  @param all Whether to flush every block rather than those in a range.
+ *  @param start The first sector of the range.
+ *  @param len The number of sectors in the range.
+ *  @param age The number of ticks a block must have been dirty for.
+ *  @param seq Blocks tied to this journal transaction or an earlier one are
+ *  flushed whatever their range and age, or INT_MIN for none.
+ *  @return 0 on success, negative error code otherwise.
+ */
+static int flush(bool all, int start, int len, unsigned age, int seq) {
+    mutex_lock(&wb.flush_lock);
+
+    mutex_lock(&wb.lock);
+    unsigned now = get_ticks();
+    wb_block_t *tail = NULL;
+    wb_block_t *prev = NULL;
+    wb_block_t *block = wb.dirty;
+    while (block != NULL) {
+        wb_block_t *next = block->next;
+        if (((all || (block->sector < start + len &&
+                      start < block->sector + block->len)) &&
+             now - block->ticks >= age) || block->seq <= seq) {
+            if (prev == NULL)
+                wb.dirty = next;
+            else
+                prev->next = next;
+            wb.dirty_len -= block->len;
+            block->next = NULL;
+            if (tail == NULL)
+                wb.writing = block;
+            else
+                tail->next = block;
+            tail = block;
+        } else {
+            prev = block;
+        }
+        block = next;
+    }
+    mutex_unlock(&wb.lock);
+
+    int rv = 0;
+
+    // Queue every block before waiting, so the disk can sort and merge them
+    for (block = wb.writing; block != NULL; block = block->next) {
+        block->dma = (dma_req_t) {
+            .addr = block->sector,
+            .pa = (unsigned)block->buf,
+            .count = block->len,
+            .write = true
+        };
+        dma_submit(&block->dma);
+    }
+
+    for (block = wb.writing; block != NULL; block = block->next) {
+        if (dma_wait(&block->dma) < 0) {
+            mutex_lock(&wb.lock);
+            insert(block->sector, block->buf, block->len, false,
+                   block->seq);
+            mutex_unlock(&wb.lock);
+            rv = -1;
+        }
+    }
+
+    mutex_lock(&wb.lock);
+    block = wb.writing;
+    wb.writing = NULL;
+    if (block != NULL)
+        wb.flushes++;
+    mutex_unlock(&wb.lock);
+
+    while (block != NULL) {
+        wb_block_t *next = block->next;
+        free_block(block);
+        block = next;
+    }
+
+    mutex_unlock(&wb.flush_lock);
+
+    return rv;
+}
+
+/** @brief Writes file data to disk later.
+ *
+ *  The data is copied, so the buffer may be reused at once.  If the data
+ *  cannot be cached it is written through instead.  The data is flushed
+ *  before the transaction seq is committed, so seq must be read with
+ *  journal_seq while the filesystem lock is held, after the operation has
+ *  logged any metadata pointing at the data.
+ *
+ *  @param sector The first sector.
+ *  @param buf The data, which must be in kernel memory.
+ *  @param count The number of sectors.
+ *  @param seq The transaction holding the metadata pointing at the data.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int writeback_write(int sector, void *buf, int count, int seq)
+{
+    mutex_lock(&wb.lock);
+    int rv = insert(sector, buf, count, true, seq);
+    bool full = wb.dirty_len > WRITEBACK_MAX_DIRTY;
+    mutex_unlock(&wb.lock);
+
+    if (rv < 0)
+        return dma_write(sector, buf, count);
+
+    // Make writers which outpace the disk pay for the flush
+    if (full && flush(true, 0, 0, 0, INT_MIN) < 0)
+        return -1;
+
+    return 0;
+}
+
+/** @brief Gets the number of flushes which have finished.
+ *
+ *  Taken before reading the disk and passed to writeback_read.
+ *
+ *  @return The number of flushes.
+ */
+unsigned writeback_flushes()
+{
+    mutex_lock(&wb.lock);
+    unsigned flushes = wb.flushes;
+    mutex_unlock(&wb.lock);
+
+    return flushes;
+}
+
+/** @brief Overlays the cached copies of sectors on data read from disk.
+ *
+ *  A flush which finished after the disk was read may have written data
+ *  the read missed and which is no longer cached, so the read must then be
+ *  retried.
+ *
+ *  @param sector The first sector read.
+ *  @param buf The data read.
+ *  @param count The number of sectors read.
+ *  @param flushes The number of flushes before the disk was read.
+ *  @return 0 on success, negative if the disk must be read again.
+ */
+int writeback_read(int sector, void *buf, int count, unsigned flushes)
+{
+    mutex_lock(&wb.lock);
+
+    if (wb.flushes != flushes) {
+        mutex_unlock(&wb.lock);
+        return -1;
+    }
+
+    // Blocks being flushed are older than any dirty block
+    wb_block_t *lists[] = { wb.writing, wb.dirty };
+    int i;
+    for (i = 0; i < 2; i++) {
+        wb_block_t *block;
+        for (block = lists[i]; block != NULL; block = block->next) {
+            int first = MAX(sector, block->sector);
+            int end = MIN(sector + count, block->sector + block->len);
+            if (first >= end)
+                continue;
+            memcpy((char *)buf + (first - sector) * IDE_SECTOR_SIZE,
+                   block->buf + (first - block->sector) * IDE_SECTOR_SIZE,
+                   (end - first) * IDE_SECTOR_SIZE);
+        }
+    }
+
+    mutex_unlock(&wb.lock);
+
+    return 0;
+}
+
+/** @brief Writes the cached sectors in a range to disk.
+ *
+ *  @param start The first sector.
+ *  @param len The number of sectors.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int writeback_flush(int start, int len)
+{
+    return flush(false, start, len, 0, INT_MIN);
+}
+
+/** @brief Writes every cached sector to disk.
+ *
+ *  @return 0 on success, negative error code otherwise.
+ */
+int writeback_sync()
+{
+    return flush(true, 0, 0, 0, INT_MIN);
+}
+
+/** @brief Writes the cached data tied to a journal transaction or an earlier
+ *  one to disk.
+ *
+ *  Called before the transaction is committed, so that its metadata never
+ *  points at data which is not yet on disk.
+ *
+ *  @param seq The sequence number of the transaction.
+ *  @return 0 on success, negative error code otherwise.
+ */
+int writeback_flush_seq(int seq)
+{
+    return flush(false, 0, 0, 0, seq);
+}
+
+/** @brief Gets the oldest journal transaction which cached data is tied to.
+ *
+ *  @return The sequence number of the transaction, or INT_MAX if no data
+ *  is cached.
+ */
+int writeback_oldest_seq()
+{
+    mutex_lock(&wb.lock);
+
+    int seq = INT_MAX;
+    wb_block_t *lists[] = { wb.writing, wb.dirty };
+    int i;
+    for (i = 0; i < 2; i++) {
+        wb_block_t *block;
+        for (block = lists[i]; block != NULL; block = block->next)
+            seq = MIN(seq, block->seq);
+    }
+
+    mutex_unlock(&wb.lock);
+
+    return seq;
+}
+
+/** @brief Drops the cached sectors in a range which has been freed.
+ *
+ *  Waits for any flush in progress, so that no write of the old data can
+ *  land once the sectors are reused.  A block partly in the range is
+ *  trimmed, or split if the range lies within it; a block which cannot be
+ *  split is written out before the sectors can be reused.
+ *
+ *  @param start The first sector.
+ *  @param len The number of sectors.
+ */
+void writeback_discard(int start, int len)
+{
+    int end = start + len;
+
+    mutex_lock(&wb.flush_lock);
+    mutex_lock(&wb.lock);
+
+    wb_block_t *prev = NULL;
+    wb_block_t *block = wb.dirty;
+    while (block != NULL && block->sector < end) {
+        wb_block_t *next = block->next;
+        int block_end = block->sector + block->len;
+        if (block_end <= start) {
+            prev = block;
+            block = next;
+            continue;
+        }
+
+        if (block->sector >= start && block_end <= end) {
+            if (prev == NULL)
+                wb.dirty = next;
+            else
+                prev->next = next;
+            wb.dirty_len -= block->len;
+            free_block(block);
+            block = next;
+            continue;
+        }
+
+        if (block->sector < start && block_end > end) {
+            char *tail_buf = block->buf + (end - block->sector) *
+                                          IDE_SECTOR_SIZE;
+            wb_block_t *tail = new_block(end, tail_buf, block_end - end,
+                                         block->seq);
+            if (tail == NULL) {
+                dma_write(end, tail_buf, block_end - end);
+                wb.dirty_len -= block_end - start;
+            } else {
+                tail->ticks = block->ticks;
+                tail->next = next;
+                block->next = tail;
+                next = tail;
+                wb.dirty_len -= len;
+            }
+            block->len = start - block->sector;
+        } else if (block->sector < start) {
+            wb.dirty_len -= block_end - start;
+            block->len = start - block->sector;
+        } else {
+            int cut = end - block->sector;
+            memmove(block->buf, block->buf + cut * IDE_SECTOR_SIZE,
+                    (block->len - cut) * IDE_SECTOR_SIZE);
+            wb.dirty_len -= cut;
+            block->sector = end;
+            block->len -= cut;
+        }
+
+        prev = block;
+        block = next;
+    }
+
+    mutex_unlock(&wb.lock);
+    mutex_unlock(&wb.flush_lock);
+}
+
+/** @brief Flushes aged dirty data and commits the journal in the
+ *  background.
+ *
+ *  Run as a kernel thread.  Each pass commits the transactions whose data
+ *  is no longer cached once the aged data has been flushed.
+ *
+ *  @return Does not return.
+ */
+void writeback_flusher()
+{
+    while (1) {
+        sleep(WRITEBACK_INTERVAL);
+        flush(true, 0, 0, WRITEBACK_AGE, INT_MIN);
+        fs_commit();
+    }
+}
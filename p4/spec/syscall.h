@@ -32,6 +32,8 @@ int sleep(int ticks);
 /* Memory management */
 int new_pages(void * addr, int len);
 int remove_pages(void * addr);
+/* mapfile() regions are read-only and are released with remove_pages() */
+int mapfile(void *addr, int len, int fd, int offset);
 
 /* Console I/O */
 char getchar(void);
@@ -77,6 +79,53 @@ int sizefile(char *filename);
 /* writefile() with count=0, create=1 creates a new empty file */
 int writefile(char *filename, char *buf, int count, int offset, int create);
 int deletefile(char *filename);
+/* clonefile() creates "to" sharing the data of "from" until either is written */
+int clonefile(char *from, char *to);
+/* preallocfile() creates or grows a file to size bytes, reading as zeros */
+int preallocfile(char *filename, int size);
+/* extentsfile() counts the extents holding a file, 0 if it is inline */
+int extentsfile(char *filename);
+
+/* Waits for disk transfers, by whether they polled the controller or slept
+ * until its interrupt.  Latencies are in processor cycles. */
+typedef struct disk_stats {
+    unsigned polled;
+    unsigned long long polled_cycles;
+    unsigned slept;
+    unsigned long long slept_cycles;
+    unsigned poll_misses;
+} disk_stats_t;
+
+/* diskpoll() polls for transfers of up to max_sectors, for max_cycles */
+int diskpoll(int max_sectors, int max_cycles);
+int diskstats(disk_stats_t *stats);
+
+/* File descriptors */
+#define O_CREAT     0x01
+#define O_RDONLY    0x02
+#define O_RDWR      0x04
+
+#define SEEK_SET    1
+#define SEEK_CUR    2
+#define SEEK_END    3
+
+int openfile(const char *filename, int flags);
+int readfd(int fd, char *buf, int count);
+int writefd(int fd, char *buf, int count);
+int seekfd(int fd, int offset, int whence);
+int closefd(int fd);
+int syncfd(int fd);
+
+/* Asynchronous file I/O */
+typedef struct aio_result {
+    int id;
+    int rv;
+} aio_result_t;
+
+int aioread(int fd, char *buf, int count, int offset);
+int aiowrite(int fd, char *buf, int count, int offset);
+int aiopoll(aio_result_t *results, int count);
+int aiowait(aio_result_t *results, int count);
 
 /* "Special" */
 void misbehave(int mode);
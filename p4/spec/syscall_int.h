@@ -48,6 +48,24 @@
 
 #define SWEXN_INT           0x74
 
+/* File descriptors, in the reserved range below */
+#define OPENFILE_INT        0x80
+#define READFD_INT          0x81
+#define WRITEFD_INT         0x82
+#define SEEKFD_INT          0x83
+#define CLOSEFD_INT         0x84
+#define MAPFILE_INT         0x85
+#define AIOREAD_INT         0x86
+#define AIOWRITE_INT        0x87
+#define AIOPOLL_INT         0x88
+#define AIOWAIT_INT         0x89
+#define CLONEFILE_INT       0x8A
+#define SYNCFD_INT          0x8B
+#define PREALLOCFILE_INT    0x8C
+#define EXTENTSFILE_INT     0x8D
+#define DISKPOLL_INT        0x8E
+#define DISKSTATS_INT       0x8F
+
 /* The syscalls in here, INCLUSIVE, are promised not to be
  * probed by any grading scripts; as such you are welcome
  * to extend the spec by making use of these syscall numbers
@@ -0,0 +1,34 @@
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CHUNK 1500
+#define APPENDS 40
+
+/* Appends grow the file's tail extent in place */
+int main(int argc, char **argv)
+{
+	char *file = argc > 1 ? argv[1] : "append.txt";
+	static char buf[CHUNK];
+	int i;
+
+	deletefile(file);
+
+	for (i = 0; i < APPENDS; i++) {
+		memset(buf, 'a' + i % 26, CHUNK);
+		if (writefile(file, buf, CHUNK, i * CHUNK, 1) != CHUNK) {
+			printf("append %d failed\n", i);
+			return -1;
+		}
+		int extents = extentsfile(file);
+		if (extents > 1) {
+			printf("append %d left the file in %d extents\n", i, extents);
+			return -1;
+		}
+	}
+
+	deletefile(file);
+	printf("append: success\n");
+	return 0;
+}
@@ -0,0 +1,22 @@
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+int main(int argc, char **argv)
+{
+	disk_stats_t stats;
+	if (argc == 3 && diskpoll(atoi(argv[1]), atoi(argv[2])) < 0)
+		return -1;
+	if (diskpoll(-1, 0) >= 0)
+		return -2;
+	if (diskstats(NULL) >= 0)
+		return -3;
+	if (diskstats(&stats) < 0)
+		return -4;
+	printf("polled: %u waits, %llu cycles\n", stats.polled,
+	       stats.polled_cycles);
+	printf("slept: %u waits, %llu cycles\n", stats.slept,
+	       stats.slept_cycles);
+	printf("poll misses: %u\n", stats.poll_misses);
+	return 0;
+}
@@ -0,0 +1,16 @@
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+int main(int argc, char **argv)
+{
+	int i;
+	for (i = 1; i < argc; i++) {
+		char *file = argv[i];
+		int extents = extentsfile(file);
+		if (extents < 0)
+			return -1 * i;
+		printf("%s: %d extents\n", file, extents);
+	}
+	return 0;
+}
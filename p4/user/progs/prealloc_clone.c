@@ -0,0 +1,85 @@
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SIZE 3000
+#define PREALLOC 40000
+
+static char buf[PREALLOC];
+
+/* Checks that file holds SIZE bytes of the pattern starting at c */
+static int check(char *file, char c)
+{
+	int i;
+	if (sizefile(file) != SIZE)
+		return -1;
+	memset(buf, 0, SIZE);
+	if (readfile(file, buf, SIZE, 0) != SIZE)
+		return -1;
+	for (i = 0; i < SIZE; i++) {
+		if (buf[i] != (char)(c + i % 26))
+			return -1;
+	}
+	return 0;
+}
+
+/* Preallocating a clone leaves the file it was cloned from alone */
+int main(int argc, char **argv)
+{
+	char *orig = "prealloc_orig.txt";
+	char *clone = "prealloc_clone.txt";
+	char *filler = "prealloc_filler.txt";
+	int i;
+
+	deletefile(orig);
+	deletefile(clone);
+	deletefile(filler);
+
+	for (i = 0; i < SIZE; i++)
+		buf[i] = 'a' + i % 26;
+	if (writefile(orig, buf, SIZE, 0, 1) != SIZE ||
+	    clonefile(orig, clone) < 0) {
+		printf("setup failed\n");
+		return -1;
+	}
+	int extents = extentsfile(orig);
+
+	if (preallocfile(clone, PREALLOC) < 0 ||
+	    sizefile(clone) != PREALLOC) {
+		printf("preallocfile failed\n");
+		return -1;
+	}
+	if (check(orig, 'a') < 0 || extentsfile(orig) != extents) {
+		printf("preallocating the clone changed the original\n");
+		return -1;
+	}
+
+	if (deletefile(clone) < 0 || check(orig, 'a') < 0) {
+		printf("deleting the clone changed the original\n");
+		return -1;
+	}
+
+	// Reuse the sectors the clone freed, then free the original's
+	for (i = 0; i < SIZE; i++)
+		buf[i] = 'A' + i % 26;
+	if (writefile(filler, buf, SIZE, 0, 1) != SIZE ||
+	    preallocfile(filler, PREALLOC) < 0 || deletefile(orig) < 0) {
+		printf("filler failed\n");
+		return -1;
+	}
+	if (readfile(filler, buf, SIZE, 0) != SIZE) {
+		printf("reading the filler failed\n");
+		return -1;
+	}
+	for (i = 0; i < SIZE; i++) {
+		if (buf[i] != (char)('A' + i % 26)) {
+			printf("deleting the original freed live data\n");
+			return -1;
+		}
+	}
+
+	deletefile(filler);
+	printf("prealloc_clone: success\n");
+	return 0;
+}
@@ -1,9 +1,18 @@
 #include <syscall.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <simics.h>
 
 int main(int argc, char **argv)
 {
-	return writefile("hello_world.txt", NULL, 42, 24, 0);
+	char *file = argc > 1 ? argv[1] : "hello_world.txt";
+	char *text = argc > 2 ? argv[2] : "Hello World!\n";
+	int offset = argc > 3 ? atoi(argv[3]) : sizefile(file);
+	if (offset < 0)
+		offset = 0;
+	int len = strlen(text);
+	if (writefile(file, text, len, offset, 1) != len)
+		return -1;
+	return 0;
 }
@@ -0,0 +1,41 @@
+#include <syscall.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+/* Zero-length writes may pass a NULL buffer, which must not be touched */
+int main(int argc, char **argv)
+{
+	char *file = argc > 1 ? argv[1] : "write_empty.txt";
+
+	if (writefile(file, NULL, 0, 0, 1) != 0) {
+		printf("writefile of 0 bytes from NULL failed\n");
+		return -1;
+	}
+	if (sizefile(file) != 0) {
+		printf("writefile of 0 bytes changed the size\n");
+		return -1;
+	}
+
+	int fd = openfile(file, O_RDWR);
+	if (fd < 0) {
+		printf("openfile failed\n");
+		return -1;
+	}
+	if (writefd(fd, NULL, 0) != 0) {
+		printf("writefd of 0 bytes from NULL failed\n");
+		return -1;
+	}
+
+	int id = aiowrite(fd, NULL, 0, 0);
+	aio_result_t result;
+	if (id < 0 || aiowait(&result, 1) != 1 || result.id != id ||
+	    result.rv != 0) {
+		printf("aiowrite of 0 bytes from NULL failed\n");
+		return -1;
+	}
+	closefd(fd);
+
+	deletefile(file);
+	printf("write_empty: success\n");
+	return 0;
+}